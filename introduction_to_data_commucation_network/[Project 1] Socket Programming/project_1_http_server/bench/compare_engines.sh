@@ -0,0 +1,29 @@
+#!/bin/bash
+# Run load_gen against the server with the epoll engine, then with the io_uring engine, with the same arguments.
+# Build the server (make in the server directory) and load_gen (make load_gen here) first, then from this directory:
+#   ./compare_engines.sh [port] [connections] [seconds] [path] [depth]
+# The server runs one worker, so both engines serve the same connections on one core,
+# and keeps its connections open for the whole run.
+
+PORT=${1:-62123}
+shift
+cd "$(dirname "$0")" || exit 1
+BENCH_DIR=$(pwd)
+
+# Returns 0 once the server accepts connections on PORT.
+port_open() {
+	(exec 3<> "/dev/tcp/127.0.0.1/$PORT") 2> /dev/null
+}
+
+for IO_URING in 0 1; do
+	(cd .. && HTTP_SERVER_WORKERS=1 HTTP_SERVER_KEEPALIVE_MAX=1000000 HTTP_SERVER_IO_URING=$IO_URING \
+		exec ./http_server "$PORT" > /dev/null 2>&1) &
+	SERVER_PID=$!
+	for i in $(seq 50); do port_open && break; sleep 0.1; done
+	if [ "$IO_URING" = 1 ]; then printf "io_uring: "; else printf "epoll:    "; fi
+	"$BENCH_DIR/load_gen" "$PORT" "$@"
+	kill "$SERVER_PID"
+	wait "$SERVER_PID" 2> /dev/null || true
+	# The workers of the server exit after it.
+	while port_open; do sleep 0.1; done
+done
@@ -0,0 +1,244 @@
+// Load generator for the server, to compare the epoll and io_uring engines side by side.
+// Keeps connections open with depth pipelined GET requests each, sends the next request of a connection
+// as soon as one of its responses is complete, and counts the responses completed over the run.
+// A connection the server closes is opened again, and counted.
+//
+// Build from this directory, start the server from the server directory with one worker and keep-alive
+// connections that are never closed, then run the generator against it:
+//   make load_gen
+//   HTTP_SERVER_WORKERS=1 HTTP_SERVER_KEEPALIVE_MAX=1000000 HTTP_SERVER_IO_URING=0 ./http_server 62123
+//   ./load_gen 62123 [connections] [seconds] [path] [depth]
+// Start the server again with HTTP_SERVER_IO_URING=1 for the io_uring engine, or let compare_engines.sh
+// run both with the same arguments.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#define LOAD_DEFAULT_CONNECTIONS 64
+#define LOAD_DEFAULT_SECONDS 5
+#define LOAD_DEFAULT_PATH "/index.html"
+#define LOAD_DEFAULT_DEPTH 1
+#define LOAD_HEADER_SIZE 8192 // Largest response header the generator reads.
+#define LOAD_READ_SIZE (256 * 1024)
+#define LOAD_MAX_EVENTS 256
+
+typedef struct load_conn_t
+{
+	int		sock;
+	char	header[LOAD_HEADER_SIZE + 1]; // Header of the response being received.
+	size_t	header_len;
+	size_t	body_left; // Bytes of the body of the response being received, once its header is complete.
+	int		in_body;
+}	load_conn_t;
+
+typedef struct load_stats_t
+{
+	long	responses;
+	long	errors; // Responses whose status is not 2xx or 3xx.
+	long	reconnects;
+	size_t	bytes;
+}	load_stats_t;
+
+struct sockaddr_in	g_server_addr;
+char				g_request[1024];
+size_t				g_request_len;
+int					g_depth;
+int					g_epoll_fd;
+
+double	load_now_sec()
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+// Send count requests on the connection. They are small, so they fit in the socket buffer.
+// Returns 0 if successful, -1 if not.
+int	load_send_requests(load_conn_t *conn, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		if (write(conn->sock, g_request, g_request_len) != (ssize_t)g_request_len)
+			return (-1);
+	}
+	return (0);
+}
+
+// Open the connection to the server and send it its first depth requests.
+// Returns 0 if successful, -1 if not.
+int	load_connect(load_conn_t *conn)
+{
+	int	one = 1;
+
+	conn->sock = socket(AF_INET, SOCK_STREAM, 0);
+	conn->header_len = 0;
+	conn->body_left = 0;
+	conn->in_body = 0;
+	if (conn->sock == -1)
+		return (-1);
+	if (connect(conn->sock, (struct sockaddr *)&g_server_addr, sizeof(g_server_addr)) == -1)
+	{
+		perror("connect");
+		close(conn->sock);
+		return (-1);
+	}
+	setsockopt(conn->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (load_send_requests(conn, g_depth) == -1)
+		return (-1);
+	fcntl(conn->sock, F_SETFL, fcntl(conn->sock, F_GETFL, 0) | O_NONBLOCK);
+	struct epoll_event	event;
+	event.events = EPOLLIN;
+	event.data.ptr = conn;
+	return (epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, conn->sock, &event));
+}
+
+// Parse the header received on the connection once it is complete, and set how much body follows.
+// Returns the number of bytes of data that belong to the header, 0 if it is not complete yet, -1 if it is too large.
+ssize_t	load_take_header(load_conn_t *conn, char *data, size_t len, load_stats_t *stats)
+{
+	size_t	old_len = conn->header_len;
+	size_t	copy_len = len < LOAD_HEADER_SIZE - old_len ? len : LOAD_HEADER_SIZE - old_len;
+
+	memcpy(conn->header + old_len, data, copy_len);
+	conn->header_len += copy_len;
+	conn->header[conn->header_len] = '\0';
+	char	*end = strstr(conn->header, "\r\n\r\n");
+	if (end == NULL)
+		return (conn->header_len == LOAD_HEADER_SIZE ? -1 : 0);
+	size_t	header_size = end + 4 - conn->header;
+	int		status = conn->header_len > 12 ? atoi(conn->header + 9) : 0;
+	char	*content_length = strcasestr(conn->header, "\r\nContent-Length:");
+	if (status < 200 || status >= 400)
+		stats->errors++;
+	conn->body_left = content_length != NULL && content_length < end ? strtoul(content_length + 17, NULL, 10) : 0;
+	conn->in_body = 1;
+	conn->header_len = 0;
+	return (header_size - old_len);
+}
+
+// Consume the bytes received on the connection, and send a new request for each response complete.
+// Returns 0 if successful, -1 if the connection should be opened again.
+int	load_consume(load_conn_t *conn, char *data, size_t len, load_stats_t *stats)
+{
+	while (len > 0 || (conn->in_body && conn->body_left == 0))
+	{
+		if (!conn->in_body)
+		{
+			ssize_t	used = load_take_header(conn, data, len, stats);
+			if (used <= 0)
+				return (used);
+			data += used;
+			len -= used;
+			continue;
+		}
+		size_t	used = len < conn->body_left ? len : conn->body_left;
+		data += used;
+		len -= used;
+		conn->body_left -= used;
+		if (conn->body_left > 0)
+			continue;
+		conn->in_body = 0;
+		stats->responses++;
+		if (load_send_requests(conn, 1) == -1)
+			return (-1);
+	}
+	return (0);
+}
+
+// Read what the server sent on the connection, until its socket has nothing more.
+// Returns 0 if successful, -1 if the connection should be opened again.
+int	load_receive(load_conn_t *conn, char *buf, load_stats_t *stats)
+{
+	while (1)
+	{
+		ssize_t	bytes_read = read(conn->sock, buf, LOAD_READ_SIZE);
+		if (bytes_read == -1 && errno == EINTR)
+			continue;
+		if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return (0);
+		if (bytes_read <= 0)
+			return (-1);
+		stats->bytes += bytes_read;
+		if (load_consume(conn, buf, bytes_read, stats) == -1)
+			return (-1);
+	}
+}
+
+int	main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s port [connections] [seconds] [path] [depth]\n", argv[0]);
+		return (1);
+	}
+	int		port = atoi(argv[1]);
+	int		conn_count = argc > 2 ? atoi(argv[2]) : LOAD_DEFAULT_CONNECTIONS;
+	double	seconds = argc > 3 ? atof(argv[3]) : LOAD_DEFAULT_SECONDS;
+	char	*path = argc > 4 ? argv[4] : LOAD_DEFAULT_PATH;
+	g_depth = argc > 5 ? atoi(argv[5]) : LOAD_DEFAULT_DEPTH;
+	if (conn_count <= 0 || seconds <= 0 || g_depth <= 0)
+	{
+		fprintf(stderr, "connections, seconds and depth must be positive\n");
+		return (1);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	memset(&g_server_addr, 0, sizeof(g_server_addr));
+	g_server_addr.sin_family = AF_INET;
+	g_server_addr.sin_port = htons(port);
+	g_server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	g_request_len = snprintf(g_request, sizeof(g_request), "GET %s HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n"
+		"Accept-Encoding: gzip\r\n\r\n", path, port);
+	g_epoll_fd = epoll_create1(0);
+	load_conn_t	*conns = (load_conn_t *)calloc(conn_count, sizeof(load_conn_t));
+	char		*buf = (char *)malloc(LOAD_READ_SIZE);
+	if (g_epoll_fd == -1 || conns == NULL || buf == NULL)
+	{
+		perror("load_gen");
+		return (1);
+	}
+	for (int i = 0; i < conn_count; i++)
+	{
+		if (load_connect(&conns[i]) == -1)
+			return (1);
+	}
+
+	load_stats_t		stats;
+	struct epoll_event	events[LOAD_MAX_EVENTS];
+	double				start = load_now_sec();
+	double				elapsed = 0;
+	memset(&stats, 0, sizeof(stats));
+	while (elapsed < seconds)
+	{
+		int	event_count = epoll_wait(g_epoll_fd, events, LOAD_MAX_EVENTS, 100);
+		for (int i = 0; i < event_count; i++)
+		{
+			load_conn_t	*conn = (load_conn_t *)events[i].data.ptr;
+			if (load_receive(conn, buf, &stats) == 0)
+				continue;
+			close(conn->sock);
+			stats.reconnects++;
+			if (load_connect(conn) == -1)
+				return (1);
+		}
+		elapsed = load_now_sec() - start;
+	}
+	printf("%s, %d connections, depth %d: %ld responses in %.2fs, %.0f req/s, %.1f MB/s, %ld errors, %ld reconnects\n",
+		path, conn_count, g_depth, stats.responses, elapsed, stats.responses / elapsed,
+		stats.bytes / elapsed / (1024 * 1024), stats.errors, stats.reconnects);
+	return (0);
+}
@@ -0,0 +1,269 @@
+// Microbenchmark of the request header parser.
+// Times the parse_http_header() the server started from, which copies every token, against
+// parse_http_request() with each header scanner, and find_header_end(), on request headers that browsers
+// send to the server.
+//
+// Build and run from this directory:
+//   make parse_bench && ./parse_bench [iterations]
+// The server sources are included as they are, so the parser is timed exactly as the server runs it.
+
+#include "../http_engine.c"
+
+#define BENCH_DEFAULT_ITERATIONS 200000
+
+// Request headers sent to the server by Chrome, Firefox, Safari and curl.
+typedef struct header_sample_t
+{
+	char	*name;
+	char	*header;
+}	header_sample_t;
+
+header_sample_t	g_samples[] = {
+	{"chrome index", "GET / HTTP/1.1\r\n"
+		"Host: 127.0.0.1:62123\r\n"
+		"Connection: keep-alive\r\n"
+		"sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+		"sec-ch-ua-mobile: ?0\r\n"
+		"sec-ch-ua-platform: \"Linux\"\r\n"
+		"Upgrade-Insecure-Requests: 1\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+		"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,"
+		"application/signed-exchange;v=b3;q=0.7\r\n"
+		"Sec-Fetch-Site: none\r\n"
+		"Sec-Fetch-Mode: navigate\r\n"
+		"Sec-Fetch-User: ?1\r\n"
+		"Sec-Fetch-Dest: document\r\n"
+		"Accept-Encoding: gzip, deflate, br\r\n"
+		"Accept-Language: ko-KR,ko;q=0.9,en-US;q=0.8,en;q=0.7\r\n"
+		"\r\n"},
+	{"chrome image", "GET /public/album/image6.jpg HTTP/1.1\r\n"
+		"Host: 127.0.0.1:62123\r\n"
+		"Connection: keep-alive\r\n"
+		"sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+		"sec-ch-ua-mobile: ?0\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+		"sec-ch-ua-platform: \"Linux\"\r\n"
+		"Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+		"Sec-Fetch-Site: same-origin\r\n"
+		"Sec-Fetch-Mode: no-cors\r\n"
+		"Sec-Fetch-Dest: image\r\n"
+		"Referer: http://127.0.0.1:62123/album.html\r\n"
+		"Accept-Encoding: gzip, deflate, br\r\n"
+		"Accept-Language: ko-KR,ko;q=0.9,en-US;q=0.8,en;q=0.7\r\n"
+		"If-None-Match: \"803-2a2b3-6512f0a1\"\r\n"
+		"If-Modified-Since: Tue, 26 Sep 2023 14:02:09 GMT\r\n"
+		"\r\n"},
+	{"chrome upload", "POST /album.html HTTP/1.1\r\n"
+		"Host: 127.0.0.1:62123\r\n"
+		"Connection: keep-alive\r\n"
+		"Content-Length: 718130\r\n"
+		"Cache-Control: max-age=0\r\n"
+		"sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+		"sec-ch-ua-mobile: ?0\r\n"
+		"sec-ch-ua-platform: \"Linux\"\r\n"
+		"Upgrade-Insecure-Requests: 1\r\n"
+		"Origin: http://127.0.0.1:62123\r\n"
+		"Content-Type: multipart/form-data; boundary=----WebKitFormBoundaryq3Dy8Y5wZ1XvC2kN\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+		"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,"
+		"application/signed-exchange;v=b3;q=0.7\r\n"
+		"Sec-Fetch-Site: same-origin\r\n"
+		"Sec-Fetch-Mode: navigate\r\n"
+		"Sec-Fetch-User: ?1\r\n"
+		"Sec-Fetch-Dest: document\r\n"
+		"Referer: http://127.0.0.1:62123/album.html\r\n"
+		"Accept-Encoding: gzip, deflate, br\r\n"
+		"Accept-Language: ko-KR,ko;q=0.9,en-US;q=0.8,en;q=0.7\r\n"
+		"\r\n"},
+	{"firefox secret", "GET /secret.html HTTP/1.1\r\n"
+		"Host: 127.0.0.1:62123\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/118.0\r\n"
+		"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+		"Accept-Language: ko-KR,ko;q=0.8,en-US;q=0.5,en;q=0.3\r\n"
+		"Accept-Encoding: gzip, deflate, br\r\n"
+		"Connection: keep-alive\r\n"
+		"Referer: http://127.0.0.1:62123/\r\n"
+		"Upgrade-Insecure-Requests: 1\r\n"
+		"Sec-Fetch-Dest: document\r\n"
+		"Sec-Fetch-Mode: navigate\r\n"
+		"Sec-Fetch-Site: same-origin\r\n"
+		"Sec-Fetch-User: ?1\r\n"
+		"Authorization: Basic RENOOkZBTEwyMDIz\r\n"
+		"\r\n"},
+	{"safari css", "GET /public/css/bootstrap.css HTTP/1.1\r\n"
+		"Host: 127.0.0.1:62123\r\n"
+		"Accept: text/css,*/*;q=0.1\r\n"
+		"Accept-Language: ko-KR,ko;q=0.9\r\n"
+		"Connection: keep-alive\r\n"
+		"Accept-Encoding: gzip, deflate\r\n"
+		"User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/605.1.15 (KHTML, like Gecko) "
+		"Version/17.0 Safari/605.1.15\r\n"
+		"Referer: http://127.0.0.1:62123/\r\n"
+		"\r\n"},
+	{"curl", "GET /index.html HTTP/1.1\r\n"
+		"Host: 127.0.0.1:62123\r\n"
+		"User-Agent: curl/7.88.1\r\n"
+		"Accept: */*\r\n"
+		"\r\n"},
+};
+
+// The parser the server started from, as it was before parse_http_request().
+char	*old_string_cutter(char *start, char *end)
+{
+	if (start == NULL || end == NULL)
+		return (NULL);
+	size_t	str_len = 0;
+	while (start[str_len] != *end)
+		str_len++;
+	char	*ret_char = (char *)calloc(str_len + 1, sizeof(char));
+	if (ret_char == NULL)
+		return (NULL);
+	size_t	str_cnt = 0;
+	while (str_cnt < str_len)
+	{
+		ret_char[str_cnt] = start[str_cnt];
+		str_cnt ++;
+	}
+	return (ret_char);
+}
+
+http_t	*old_parse_http_header(char *header_str)
+{
+	char	*string_cut_ptr1 = header_str;
+	char	*string_cut_ptr2 = strstr(header_str, " ");
+	char	*http_method = old_string_cutter(string_cut_ptr1, string_cut_ptr2);
+	char	*http_path = old_string_cutter(string_cut_ptr2 + 1, string_cut_ptr1 = strstr(string_cut_ptr2 + 1, " "));
+	char	*http_version = old_string_cutter(string_cut_ptr1 + 1, string_cut_ptr2 = strstr(string_cut_ptr1 + 1, "\r\n"));
+
+	if (http_method == NULL || http_path == NULL || http_version == NULL)
+	{
+		free(http_method);
+		free(http_path);
+		free(http_version);
+		return (NULL);
+	}
+	http_t	*http = init_http_with_arg(http_method, http_path, http_version, "");
+	free(http_method);
+	free(http_path);
+	free(http_version);
+	free(http->status);
+	http->status = NULL;
+	while (strncmp(string_cut_ptr2, "\r\n\r\n", 4) != 0)
+	{
+		char	*http_field = old_string_cutter(string_cut_ptr2 + 2, string_cut_ptr1 = strstr(string_cut_ptr2 + 2, ":"));
+		char	*http_val = old_string_cutter(string_cut_ptr1 + 2, string_cut_ptr2 = strstr(string_cut_ptr1 + 2, "\r\n"));
+		if (http_field == NULL || http_val == NULL || add_field_to_http(http, http_field, http_val) == -1)
+		{
+			free(http_field);
+			free(http_val);
+			free_http(http);
+			return (NULL);
+		}
+		free(http_field);
+		free(http_val);
+	}
+	return (http);
+}
+
+double	bench_now_nsec()
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+// Each parser gets a fresh copy of the header, as the server does with the bytes it receives:
+// parse_http_request() writes '\0' after its tokens.
+double	bench_old_parser(char *header, size_t len, char *buf, long iterations)
+{
+	double	start = bench_now_nsec();
+
+	for (long i = 0; i < iterations; i++)
+	{
+		memcpy(buf, header, len + 1);
+		http_t	*http = old_parse_http_header(buf);
+		if (http == NULL)
+			return (-1);
+		free_http(http);
+	}
+	return ((bench_now_nsec() - start) / iterations);
+}
+
+double	bench_new_parser(char *header, size_t len, char *buf, long iterations)
+{
+	http_request_t	request;
+	double			start = bench_now_nsec();
+
+	for (long i = 0; i < iterations; i++)
+	{
+		memcpy(buf, header, len + 1);
+		if (parse_http_request(buf, len, &request) != (ssize_t)len)
+			return (-1);
+	}
+	return ((bench_now_nsec() - start) / iterations);
+}
+
+double	bench_header_end(char *header, size_t len, long iterations)
+{
+	volatile size_t	end = 0;
+	double			start = bench_now_nsec();
+
+	for (long i = 0; i < iterations; i++)
+		end += find_header_end(header, len);
+	return (end == 0 ? -1 : (bench_now_nsec() - start) / iterations);
+}
+
+int	main(int argc, char **argv)
+{
+	long			iterations = argc > 1 ? atol(argv[1]) : BENCH_DEFAULT_ITERATIONS;
+	char			buf[MAX_HTTP_MSG_HEADER_SIZE + 1];
+	find_any_func_t	scanners[] = {find_any_scalar, NULL, NULL};
+
+	if (iterations <= 0)
+		iterations = BENCH_DEFAULT_ITERATIONS;
+	init_known_headers();
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+		scanners[1] = find_any_sse42;
+	if (__builtin_cpu_supports("avx2"))
+		scanners[2] = find_any_avx2;
+#endif
+	printf("%ld iterations, ns per header. end is find_header_end() with the widest scanner.\n", iterations);
+	printf("%-16s %6s %8s %10s %10s %10s %10s %10s %10s\n", "sample", "bytes", "fields", "old",
+		"scalar", "sse4.2", "avx2", "end", "speedup");
+	for (size_t s = 0; s < sizeof(g_samples) / sizeof(g_samples[0]); s++)
+	{
+		char	*header = g_samples[s].header;
+		size_t	len = strlen(header);
+		int		fields = 0;
+		double	new_nsec[3] = {-1, -1, -1};
+		double	end_nsec = -1;
+		double	best = -1;
+
+		for (size_t i = 0; i + 1 < len; i++)
+			fields += header[i] == '\r' && header[i + 1] == '\n';
+		double	old_nsec = bench_old_parser(header, len, buf, iterations);
+		for (int k = 0; k < 3; k++)
+		{
+			if (scanners[k] == NULL)
+				continue;
+			g_find_any = scanners[k];
+			new_nsec[k] = bench_new_parser(header, len, buf, iterations);
+			end_nsec = bench_header_end(header, len, iterations);
+			if (new_nsec[k] > 0 && (best < 0 || new_nsec[k] < best))
+				best = new_nsec[k];
+		}
+		printf("%-16s %6zu %8d %10.0f", g_samples[s].name, len, fields - 2, old_nsec);
+		for (int k = 0; k < 3; k++)
+		{
+			if (new_nsec[k] < 0)
+				printf(" %10s", "n/a");
+			else
+				printf(" %10.0f", new_nsec[k]);
+		}
+		printf(" %10.0f %9.1fx\n", end_nsec, best > 0 ? old_nsec / best : 0);
+	}
+	return (0);
+}
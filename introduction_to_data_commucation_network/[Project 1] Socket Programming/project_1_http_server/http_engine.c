@@ -2,44 +2,260 @@
 // Written by Jongseok Park (cakeng@snu.ac.kr)
 // 2023. 9. 11
 
+#define _GNU_SOURCE
 #include "http_functions.h"
 #include "sys/socket.h"
 #include "arpa/inet.h"
 #include "netinet/tcp.h"
+#include "errno.h"
+#include "fcntl.h"
+#include "time.h"
+#include "strings.h"
+#include "stdint.h"
+#include "ctype.h"
+#include "sys/stat.h"
+#include "sys/uio.h"
+#include "sys/mman.h"
+#ifdef __linux__
+#include "sys/epoll.h"
+#include "sys/sendfile.h"
+#include "sys/wait.h"
+#include "sys/prctl.h"
+#include "sys/eventfd.h"
+#include "sched.h"
+#include "pthread.h"
+#include "poll.h"
+// The io_uring engine is built when the kernel headers have it, unless compiled with -DNO_IO_URING.
+// It is used by raw system calls, so the server does not depend on liburing.
+#if defined(__has_include) && !defined(NO_IO_URING)
+#if __has_include("linux/io_uring.h")
+#define HAVE_IO_URING
+#include "linux/io_uring.h"
+#include "sys/syscall.h"
+#endif
+#endif
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include "immintrin.h"
+#endif
 
 
-#define MAX_WAITING_CONNECTIONS 10 // Maximum number of waiting connections
+#define MAX_WAITING_CONNECTIONS SOMAXCONN // Maximum number of waiting connections
+#define MAX_EPOLL_EVENTS 256 // Maximum number of events handled per epoll_wait()
+#define MAX_QUEUED_RESPONSES 16 // Maximum number of pipelined responses queued per connection
+#define LINGER_TIMEOUT_MSEC 2000 // Longest time a connection the server closes discards what its client still sends
+#define MAX_REQUEST_HEADERS 64 // Maximum number of header fields of a request
+#define ARENA_BLOCK_SIZE 4096 // Size of the blocks of the per-connection arena
+#define HEADER_POOL_MAX 256 // Header buffers a worker keeps for reuse, more are freed
+#define KNOWN_HEADER_SLOTS 64 // Hash slots of the known header names, a power of 2
+#define OTHER_HEADER_SLOTS 128 // Hash slots of the other header fields of a request, a power of 2 above MAX_REQUEST_HEADERS
+#define MAX_OUT_SEGMENTS 3 // Maximum number of memory segments of a queued response
+#define MAX_IOVECS 64 // Maximum number of segments sent per sendmsg()
+#define CONTENT_CACHE_BUCKETS 1024 // Number of hash buckets of the content cache
+#define FD_CACHE_BUCKETS 512 // Number of hash buckets of the open file cache
+#define HTTP_VERSION "HTTP/1.1" // Version of every response. HTTP/1.0 clients are answered with close semantics.
 #define MAX_PATH_SIZE 256 // Maximum size of path
+#define INDEX_FILE "index.html" // File served for a directory
+#define PARSE_NEED_MORE 0 // parse_http_request(): the header is not complete yet
+#define PARSE_BAD_REQUEST -1 // parse_http_request(): the header is malformed
+#define PARSE_TOO_MANY_FIELDS -2 // parse_http_request(): the header has more than MAX_REQUEST_HEADERS fields
 #define SERVER_ROOT "./server_root"
 #define ALBUM_PATH "/public/album"
 #define ALBUM_HTML_PATH "./server_root/public/album/album_images.html"
+#define BODY_CHUNK_SIZE (16 * 1024) // Size of the chunks the body of a request is received in
+#define UPLOAD_WINDOW_SIZE (64 * 1024) // Bytes of an upload buffered to search for the multipart boundary
+#define MAX_BOUNDARY_SIZE 70 // Maximum length of a multipart boundary (RFC 2046)
+#define MAX_PART_HEADER_SIZE 1024 // Maximum size of the header of a multipart part
+#define MAX_RANGES 16 // Maximum number of ranges served for a Range field, more are answered with the whole file
+#define MAX_FILENAME_SIZE 128 // Maximum size of the name of an uploaded image
+#define UPLOAD_SPLICE_TAIL (64 * 1024) // Bytes at the end of an upload always parsed in user space: the delimiter that ends the image and the parts after it
+#define UPLOAD_PIPE_SIZE (1024 * 1024) // Requested capacity of the pipe uploads are spliced through
+#define IO_QUEUE_MAX 1024 // Maximum number of jobs waiting for the I/O pool, more are run by the event loop itself
+#define URING_ENTRIES 1024 // Submission queue entries of the io_uring of a worker
+#define URING_BUFFER_COUNT 256 // Receive buffers of the io_uring of a worker, a power of 2
+#define URING_BUFFER_SIZE (8 * 1024) // Size of each receive buffer
+#define URING_BUFFER_GROUP 0 // Buffer group id of the receive buffers
+#define URING_CONN_BUFFERS 16 // Receive buffers a connection may hold before it stops receiving
+#define DEFLATE_WINDOW_SIZE 32768 // Farthest distance a deflate match may reach back (RFC 1951)
+#define DEFLATE_HASH_BITS 15 // Bits of the hash of the 3 bytes starting a match
+#define DEFLATE_MAX_CHAIN 128 // Maximum number of earlier positions compared when looking for a match
+#define DEFLATE_BLOCK_SYMBOLS 16384 // Literals and matches per deflate block, each block with its own Huffman codes
 #define ALBUM_HTML_TEMPLATE "<div class=\"card\"> <img src=\"/public/album/%s\" alt=\"Unable to load %s\"> </div>\n"
 
-char	*find_content_type(char *file_ext, char *request_accept)
+// Cache-Control of the static assets, with the max-age of g_config. Set by load_server_config().
+char	g_static_cache_control[48];
+
+// Server configuration, read from the environment once by load_server_config().
+typedef struct server_config_t
 {
-	char	*tmp_acpt = copy_string(request_accept);
-	
-	if (strstr(tmp_acpt, file_ext) == NULL)
-	{
-		free(tmp_acpt);
-		if (strcmp(file_ext, "html") == 0)
-			return (copy_string("text/html"));
-		if (strcmp(file_ext, "css") == 0)
-			return (copy_string("text/css"));
-		if (strcmp(file_ext, "js") == 0)
-			return (copy_string("text/javascript"));
-		if (strcmp(file_ext, "jpg") == 0)
-			return (copy_string("image/jpeg"));
-		if (strcmp(file_ext, "ico") == 0)
-			return (copy_string("application/octet-stream"));
-	}
-	char	*content_type = strtok(tmp_acpt, ",;");
-	while (strstr(content_type, file_ext) == NULL)
+	int	num_workers; // HTTP_SERVER_WORKERS: number of worker processes, default is the number of online cores.
+	int	pin_workers; // HTTP_SERVER_PIN_WORKERS: pin each worker to its own core if non-zero, default 1.
+	int	keepalive_timeout; // HTTP_SERVER_KEEPALIVE_TIMEOUT: seconds an idle connection is kept open, 0 disables keep-alive. Default 5.
+	int	keepalive_max; // HTTP_SERVER_KEEPALIVE_MAX: maximum number of requests served per connection, default 100.
+	size_t	cache_size; // HTTP_SERVER_CACHE_SIZE: bytes of static content cached in memory per worker, 0 disables the cache. Default 32MB.
+	size_t	cache_max_entry; // HTTP_SERVER_CACHE_MAX_ENTRY: files larger than this are not cached but sent with sendfile(). Default 1MB.
+	size_t	cache_ttl_msec; // HTTP_SERVER_CACHE_TTL: milliseconds an open file is trusted before it is checked with stat() again. Default 1000.
+	size_t	fd_cache_max; // HTTP_SERVER_FD_CACHE_MAX: open files kept per worker, 0 disables the open file cache. Default 256.
+	size_t	fd_cache_inactive_msec; // HTTP_SERVER_FD_CACHE_INACTIVE: seconds an unused file is kept open, default 20.
+	int		simd_level; // HTTP_SERVER_SIMD: widest header scanner to use, 0 scalar, 1 SSE4.2, 2 AVX2 (default).
+	long	static_max_age; // HTTP_SERVER_STATIC_MAX_AGE: seconds browsers may reuse the files under /public/ without asking, default 86400.
+	size_t	compress_min_size; // HTTP_SERVER_COMPRESS_MIN_SIZE: smaller text files are not compressed by the server, default 256.
+	int		io_threads; // HTTP_SERVER_IO_THREADS: threads per worker that do the disk I/O, 0 does it in the event loop. Default 4.
+	int		io_uring; // HTTP_SERVER_IO_URING: serve the connections with io_uring instead of epoll if non-zero and supported, default 0.
+	size_t	send_chunk_size; // HTTP_SERVER_SEND_CHUNK_SIZE: bytes of a file body copied at a time where sendfile() is not used, and spliced at a time by the io_uring engine, default 64KB.
+}	server_config_t;
+
+server_config_t	g_config;
+
+// Returns the integer value of the environment variable name, or default_val if it is not set or invalid.
+long	get_env_long(char *name, long default_val)
+{
+	char	*val = getenv(name);
+	char	*end = NULL;
+
+	if (val == NULL || *val == '\0')
+		return (default_val);
+	long	ret = strtol(val, &end, 10);
+	if (*end != '\0')
 	{
-		content_type = strtok(NULL, ",;");
+		ERROR_PRTF ("SERVER ERROR: Invalid value for %s: %s\n", name, val);
+		return (default_val);
 	}
-	free(tmp_acpt);
-	return (content_type);
+	return (ret);
+}
+
+void	load_server_config()
+{
+	long	num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+	g_config.num_workers = get_env_long("HTTP_SERVER_WORKERS", num_cores > 0 ? num_cores : 1);
+	if (g_config.num_workers < 1)
+		g_config.num_workers = 1;
+	g_config.pin_workers = get_env_long("HTTP_SERVER_PIN_WORKERS", 1);
+	g_config.keepalive_timeout = get_env_long("HTTP_SERVER_KEEPALIVE_TIMEOUT", 5);
+	if (g_config.keepalive_timeout < 0)
+		g_config.keepalive_timeout = 0;
+	g_config.keepalive_max = get_env_long("HTTP_SERVER_KEEPALIVE_MAX", 100);
+	if (g_config.keepalive_max < 1)
+		g_config.keepalive_max = 1;
+	long	cache_size = get_env_long("HTTP_SERVER_CACHE_SIZE", 32 * 1024 * 1024);
+	g_config.cache_size = cache_size > 0 ? cache_size : 0;
+	long	cache_max_entry = get_env_long("HTTP_SERVER_CACHE_MAX_ENTRY", 1024 * 1024);
+	g_config.cache_max_entry = cache_max_entry > 0 ? cache_max_entry : 0;
+	long	cache_ttl = get_env_long("HTTP_SERVER_CACHE_TTL", 1000);
+	g_config.cache_ttl_msec = cache_ttl > 0 ? cache_ttl : 0;
+	long	fd_cache_max = get_env_long("HTTP_SERVER_FD_CACHE_MAX", 256);
+	g_config.fd_cache_max = fd_cache_max > 0 ? fd_cache_max : 0;
+	long	fd_cache_inactive = get_env_long("HTTP_SERVER_FD_CACHE_INACTIVE", 20);
+	g_config.fd_cache_inactive_msec = fd_cache_inactive > 0 ? fd_cache_inactive * 1000 : 0;
+	g_config.simd_level = get_env_long("HTTP_SERVER_SIMD", 2);
+	long	static_max_age = get_env_long("HTTP_SERVER_STATIC_MAX_AGE", 86400);
+	g_config.static_max_age = static_max_age > 0 ? static_max_age : 0;
+	sprintf(g_static_cache_control, "public, max-age=%ld", g_config.static_max_age);
+	long	compress_min_size = get_env_long("HTTP_SERVER_COMPRESS_MIN_SIZE", 256);
+	g_config.compress_min_size = compress_min_size > 0 ? compress_min_size : 0;
+	g_config.io_threads = get_env_long("HTTP_SERVER_IO_THREADS", 4);
+	if (g_config.io_threads < 0)
+		g_config.io_threads = 0;
+	g_config.io_uring = get_env_long("HTTP_SERVER_IO_URING", 0);
+	long	send_chunk_size = get_env_long("HTTP_SERVER_SEND_CHUNK_SIZE", 64 * 1024);
+	g_config.send_chunk_size = send_chunk_size >= 4096 ? send_chunk_size : 4096;
+}
+
+// Returns the time of a monotonic clock in microseconds.
+size_t	get_time_usec()
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+// Returns the time of a monotonic clock in milliseconds.
+size_t	get_time_msec()
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+#define MIME_SLOTS 64
+// Hash of a file extension for g_mime_types, from its first, second and last characters and its length.
+// It has no collisions among the extensions of the table.
+#define MIME_HASH(first, second, last, len) ((3 * ((first) + (second)) + 8 * (last) + (len)) & (MIME_SLOTS - 1))
+#define DEFAULT_CONTENT_TYPE "application/octet-stream"
+
+typedef struct mime_type_t
+{
+	char	*ext;
+	char	*type;
+	int		compressible; // Text that gzip makes smaller, unlike the formats that are compressed already.
+}	mime_type_t;
+
+// Content types of the served files, by the perfect hash of their (lowercase) extension.
+mime_type_t	g_mime_types[MIME_SLOTS] = {
+	[MIME_HASH('h', 't', 'l', 4)] = {"html", "text/html", 1},
+	[MIME_HASH('h', 't', 'm', 3)] = {"htm", "text/html", 1},
+	[MIME_HASH('c', 's', 's', 3)] = {"css", "text/css", 1},
+	[MIME_HASH('j', 's', 's', 2)] = {"js", "text/javascript", 1},
+	[MIME_HASH('m', 'j', 's', 3)] = {"mjs", "text/javascript", 1},
+	[MIME_HASH('j', 's', 'n', 4)] = {"json", "application/json", 1},
+	[MIME_HASH('t', 'x', 't', 3)] = {"txt", "text/plain", 1},
+	[MIME_HASH('x', 'm', 'l', 3)] = {"xml", "application/xml", 1},
+	[MIME_HASH('c', 's', 'v', 3)] = {"csv", "text/csv", 1},
+	[MIME_HASH('j', 'p', 'g', 3)] = {"jpg", "image/jpeg", 0},
+	[MIME_HASH('j', 'p', 'g', 4)] = {"jpeg", "image/jpeg", 0},
+	[MIME_HASH('p', 'n', 'g', 3)] = {"png", "image/png", 0},
+	[MIME_HASH('g', 'i', 'f', 3)] = {"gif", "image/gif", 0},
+	[MIME_HASH('s', 'v', 'g', 3)] = {"svg", "image/svg+xml", 1},
+	[MIME_HASH('i', 'c', 'o', 3)] = {"ico", "image/x-icon", 0},
+	[MIME_HASH('w', 'e', 'p', 4)] = {"webp", "image/webp", 0},
+	[MIME_HASH('a', 'v', 'f', 4)] = {"avif", "image/avif", 0},
+	[MIME_HASH('b', 'm', 'p', 3)] = {"bmp", "image/bmp", 0},
+	[MIME_HASH('m', 'p', '3', 3)] = {"mp3", "audio/mpeg", 0},
+	[MIME_HASH('m', 'p', '4', 3)] = {"mp4", "video/mp4", 0},
+	[MIME_HASH('w', 'e', 'm', 4)] = {"webm", "video/webm", 0},
+	[MIME_HASH('o', 'g', 'g', 3)] = {"ogg", "audio/ogg", 0},
+	[MIME_HASH('w', 'a', 'v', 3)] = {"wav", "audio/wav", 0},
+	[MIME_HASH('w', 'o', 'f', 4)] = {"woff", "font/woff", 0},
+	[MIME_HASH('w', 'o', '2', 5)] = {"woff2", "font/woff2", 0},
+	[MIME_HASH('t', 't', 'f', 3)] = {"ttf", "font/ttf", 1},
+	[MIME_HASH('o', 't', 'f', 3)] = {"otf", "font/otf", 1},
+	[MIME_HASH('p', 'd', 'f', 3)] = {"pdf", "application/pdf", 0},
+	[MIME_HASH('z', 'i', 'p', 3)] = {"zip", "application/zip", 0},
+	[MIME_HASH('w', 'a', 'm', 4)] = {"wasm", "application/wasm", 1},
+};
+
+// Returns the entry of g_mime_types of the extension file_ext (case-insensitive, may be NULL), NULL if it has none.
+mime_type_t	*find_mime_type(char *file_ext)
+{
+	size_t	len = file_ext != NULL ? strlen(file_ext) : 0;
+
+	if (len < 2 || strchr(file_ext, '/') != NULL)
+		return (NULL);
+	mime_type_t	*mime = &g_mime_types[MIME_HASH(tolower((unsigned char)file_ext[0]),
+		tolower((unsigned char)file_ext[1]), tolower((unsigned char)file_ext[len - 1]), len)];
+	if (mime->ext == NULL || strcasecmp(mime->ext, file_ext) != 0)
+		return (NULL);
+	return (mime);
+}
+
+// Returns the Content-Type of a file with the extension file_ext.
+// Files of an unknown type are sent as DEFAULT_CONTENT_TYPE.
+char	*find_content_type(char *file_ext)
+{
+	mime_type_t	*mime = find_mime_type(file_ext);
+
+	return (mime != NULL ? mime->type : DEFAULT_CONTENT_TYPE);
+}
+
+// Returns 1 if the files with the extension file_ext are worth compressing, 0 if not.
+int	is_compressible_type(char *file_ext)
+{
+	mime_type_t	*mime = find_mime_type(file_ext);
+
+	return (mime != NULL && mime->compressible);
 }
 
 char	*string_cutter(char *start, char *end)
@@ -62,488 +278,5240 @@ char	*string_cutter(char *start, char *end)
 	return (ret_char);
 }
 
-// You are NOT REQUIRED to implement and use parse_http_header() function for this project.
-// However, if you do, you will be able to use the http struct and its member functions,
-// which will make things MUCH EASIER for you. We highly recommend you to do so.
-// HINT: Use strtok() to tokenize the header strings, based on the delimiters.
-http_t *parse_http_header (char *header_str)
+// Delimiter scanning for the request parser, picked once at startup by select_scanner().
+// Returns the offset of the first byte of buf equal to a, b or c, or len if there is none.
+typedef size_t	(*find_any_func_t)(const char *buf, size_t len, char a, char b, char c);
+
+size_t	find_any_scalar(const char *buf, size_t len, char a, char b, char c)
+{
+	for (size_t i = 0; i < len; i++)
+		if (buf[i] == a || buf[i] == b || buf[i] == c)
+			return (i);
+	return (len);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+// 16 bytes at a time, with the "equal any" string compare of SSE4.2.
+__attribute__((target("sse4.2")))
+size_t	find_any_sse42(const char *buf, size_t len, char a, char b, char c)
 {
-    http_t *http = init_http();
-	char	*string_cut_ptr1 = header_str;
-	char	*string_cut_ptr2 = strstr(header_str, " ");
-	char	*http_method = string_cutter(string_cut_ptr1, string_cut_ptr2);
-	char	*http_path = string_cutter(string_cut_ptr2 + 1, string_cut_ptr1 = strstr(string_cut_ptr2 + 1, " "));
-	char	*http_version = string_cutter(string_cut_ptr1 + 1 , string_cut_ptr2 = strstr(string_cut_ptr1 + 1, "\r\n"));
-	char	*http_field;
-	char	*http_val;
+	__m128i	set = _mm_setr_epi8(a, b, c, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	size_t	i = 0;
 
-	if (http_method == NULL || http_path == NULL || http_version == NULL)
+	for (; i + 16 <= len; i += 16)
 	{
-		free_http(http);
-		return (NULL);
+		__m128i	chunk = _mm_loadu_si128((const __m128i *)(buf + i));
+		int		idx = _mm_cmpestri(set, 3, chunk, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+		if (idx < 16)
+			return (i + idx);
 	}
-	http = init_http_with_arg(http_method, http_path, http_version, "");
-	free(http_method);
-	free(http_path);
-	free(http_version);
-	http->status = NULL;
-	while (strncmp(string_cut_ptr2, "\r\n\r\n", 4) != 0)
+	return (i + find_any_scalar(buf + i, len - i, a, b, c));
+}
+
+// 32 bytes at a time, comparing against each delimiter and merging the matches into a bit mask.
+__attribute__((target("avx2")))
+size_t	find_any_avx2(const char *buf, size_t len, char a, char b, char c)
+{
+	__m256i	va = _mm256_set1_epi8(a);
+	__m256i	vb = _mm256_set1_epi8(b);
+	__m256i	vc = _mm256_set1_epi8(c);
+	size_t	i = 0;
+
+	for (; i + 32 <= len; i += 32)
+	{
+		__m256i			chunk = _mm256_loadu_si256((const __m256i *)(buf + i));
+		__m256i			match = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, va),
+			_mm256_cmpeq_epi8(chunk, vb)), _mm256_cmpeq_epi8(chunk, vc));
+		unsigned int	mask = _mm256_movemask_epi8(match);
+		if (mask != 0)
+			return (i + __builtin_ctz(mask));
+	}
+	return (i + find_any_scalar(buf + i, len - i, a, b, c));
+}
+#endif
+
+find_any_func_t	g_find_any = find_any_scalar;
+
+// Use the widest scanner the CPU supports, up to g_config.simd_level.
+void	select_scanner()
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	__builtin_cpu_init();
+	if (g_config.simd_level >= 2 && __builtin_cpu_supports("avx2"))
+		g_find_any = find_any_avx2;
+	else if (g_config.simd_level >= 1 && __builtin_cpu_supports("sse4.2"))
+		g_find_any = find_any_sse42;
+#endif
+}
+
+// Find the blank line that ends a request header ("\r\n\r\n", or "\n\n" from lenient clients),
+// jumping from line end to line end with the scanner.
+// Returns the offset right after it, or 0 if it is not received yet.
+size_t	find_header_end(const char *buf, size_t len)
+{
+	size_t	pos = 0;
+
+	while ((pos += g_find_any(buf + pos, len - pos, '\n', '\n', '\n')) < len)
+	{
+		pos++;
+		if (pos < len && buf[pos] == '\n')
+			return (pos + 1);
+		if (pos + 1 < len && buf[pos] == '\r' && buf[pos + 1] == '\n')
+			return (pos + 2);
+	}
+	return (0);
+}
+
+// A part of the receive buffer, as an offset and a length, so parsing a request copies nothing.
+typedef struct http_view_t
+{
+	unsigned int	off;
+	unsigned int	len;
+}	http_view_t;
+
+// Header fields the server looks up. parse_http_request() interns their names, so they are found without a search.
+typedef enum header_id_t
+{
+	HDR_HOST,
+	HDR_CONNECTION,
+	HDR_CONTENT_LENGTH,
+	HDR_CONTENT_TYPE,
+	HDR_TRANSFER_ENCODING,
+	HDR_EXPECT,
+	HDR_ACCEPT,
+	HDR_ACCEPT_ENCODING,
+	HDR_AUTHORIZATION,
+	HDR_RANGE,
+	HDR_IF_RANGE,
+	HDR_IF_NONE_MATCH,
+	HDR_IF_MODIFIED_SINCE,
+	HDR_CACHE_CONTROL,
+	HDR_COOKIE,
+	HDR_REFERER,
+	HDR_USER_AGENT,
+	HDR_COUNT,
+	HDR_OTHER = HDR_COUNT
+}	header_id_t;
+
+char	*g_known_header_names[HDR_COUNT] = {
+	[HDR_HOST] = "Host",
+	[HDR_CONNECTION] = "Connection",
+	[HDR_CONTENT_LENGTH] = "Content-Length",
+	[HDR_CONTENT_TYPE] = "Content-Type",
+	[HDR_TRANSFER_ENCODING] = "Transfer-Encoding",
+	[HDR_EXPECT] = "Expect",
+	[HDR_ACCEPT] = "Accept",
+	[HDR_ACCEPT_ENCODING] = "Accept-Encoding",
+	[HDR_AUTHORIZATION] = "Authorization",
+	[HDR_RANGE] = "Range",
+	[HDR_IF_RANGE] = "If-Range",
+	[HDR_IF_NONE_MATCH] = "If-None-Match",
+	[HDR_IF_MODIFIED_SINCE] = "If-Modified-Since",
+	[HDR_CACHE_CONTROL] = "Cache-Control",
+	[HDR_COOKIE] = "Cookie",
+	[HDR_REFERER] = "Referer",
+	[HDR_USER_AGENT] = "User-Agent",
+};
+
+// Open-addressed hash table of the known header names, header_id_t + 1 per slot, 0 if empty.
+// Filled once by init_known_headers().
+unsigned char	g_known_header_slots[KNOWN_HEADER_SLOTS];
+
+// Case-insensitive FNV-1a hash of a header name.
+unsigned int	hash_header_name(const char *name, size_t len)
+{
+	unsigned int	hash = 2166136261u;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		hash ^= (unsigned char)tolower((unsigned char)name[i]);
+		hash *= 16777619u;
+	}
+	return (hash);
+}
+
+// Insert every known header name into g_known_header_slots.
+void	init_known_headers()
+{
+	for (int id = 0; id < HDR_COUNT; id++)
+	{
+		char			*known = g_known_header_names[id];
+		unsigned int	slot = hash_header_name(known, strlen(known)) & (KNOWN_HEADER_SLOTS - 1);
+		while (g_known_header_slots[slot] != 0)
+			slot = (slot + 1) & (KNOWN_HEADER_SLOTS - 1);
+		g_known_header_slots[slot] = id + 1;
+	}
+}
+
+// Returns the id of the header name of len bytes with the given hash, or HDR_OTHER if it is not a known one.
+header_id_t	intern_header_name(const char *name, size_t len, unsigned int hash)
+{
+	for (unsigned int slot = hash & (KNOWN_HEADER_SLOTS - 1); g_known_header_slots[slot] != 0;
+		slot = (slot + 1) & (KNOWN_HEADER_SLOTS - 1))
+	{
+		char	*known = g_known_header_names[g_known_header_slots[slot] - 1];
+		if (strlen(known) == len && strncasecmp(known, name, len) == 0)
+			return (g_known_header_slots[slot] - 1);
+	}
+	return (HDR_OTHER);
+}
+
+typedef struct http_header_t
+{
+	http_view_t	name;
+	http_view_t	val;
+}	http_header_t;
+
+// A request parsed in place in the receive buffer, with a fixed-capacity table of header fields.
+// Once the header is complete, every view is followed by a '\0' in the buffer, see request_str().
+// Fields are indexed by name: known ones in a slot per header_id_t, the others in a small hash table.
+// Both hold the index + 1 of the first field with the name, 0 if there is none.
+typedef struct http_request_t
+{
+	char			*buf; // Receive buffer the views point into.
+	http_view_t		method;
+	http_view_t		path;
+	http_view_t		version;
+	int				header_count;
+	http_header_t	headers[MAX_REQUEST_HEADERS];
+	unsigned char	known_headers[HDR_COUNT];
+	unsigned char	other_headers[OTHER_HEADER_SLOTS];
+}	http_request_t;
+
+// Returns the view as a C string. Only valid once parse_http_request() has returned a complete header.
+char	*request_str(http_request_t *request, http_view_t view)
+{
+	return (request->buf + view.off);
+}
+
+// Scan from *pos to the first delim on the current line.
+// Returns 1 with the bytes before delim in view and *pos right after delim,
+// 0 if delim is not received yet, -1 if the line ends before delim.
+int	scan_token(char *buf, size_t len, size_t *pos, char delim, http_view_t *view)
+{
+	size_t	i = *pos + g_find_any(buf + *pos, len - *pos, delim, '\r', '\n');
+
+	if (i == len)
+		return (0);
+	if (buf[i] != delim)
+		return (-1);
+	view->off = *pos;
+	view->len = i - *pos;
+	*pos = i + 1;
+	return (1);
+}
+
+// Scan from *pos to the end of the line, "\r\n" or a bare "\n".
+// Returns 1 with the line in view and *pos at the next line, 0 if the line end is not received yet.
+int	scan_line(char *buf, size_t len, size_t *pos, http_view_t *view)
+{
+	size_t	end = *pos + g_find_any(buf + *pos, len - *pos, '\n', '\n', '\n');
+
+	if (end == len)
+		return (0);
+	view->off = *pos;
+	view->len = end - *pos;
+	if (view->len > 0 && buf[end - 1] == '\r')
+		view->len--;
+	*pos = end + 1;
+	return (1);
+}
+
+// Add the idx-th header field of the request to its index, unless a field with the same name comes before it.
+void	index_request_header(http_request_t *request, int idx)
+{
+	http_view_t		name = request->headers[idx].name;
+	unsigned int	hash = hash_header_name(request->buf + name.off, name.len);
+	header_id_t		id = intern_header_name(request->buf + name.off, name.len, hash);
+
+	if (id != HDR_OTHER)
+	{
+		if (request->known_headers[id] == 0)
+			request->known_headers[id] = idx + 1;
+		return ;
+	}
+	unsigned int	slot = hash & (OTHER_HEADER_SLOTS - 1);
+	while (request->other_headers[slot] != 0)
+	{
+		http_view_t	other = request->headers[request->other_headers[slot] - 1].name;
+		if (other.len == name.len && strncasecmp(request->buf + other.off, request->buf + name.off, name.len) == 0)
+			return ;
+		slot = (slot + 1) & (OTHER_HEADER_SLOTS - 1);
+	}
+	request->other_headers[slot] = idx + 1;
+}
+
+// Parse the request line and header fields in the first len bytes of buf, without copying or allocating.
+// The whole header is parsed again on every call, so callers wait for find_header_end() first.
+// Once it is complete, the delimiter after every view is overwritten with '\0'.
+// Returns the size of the header, blank line included, if it is complete. Otherwise returns
+// PARSE_NEED_MORE if more bytes are needed, PARSE_BAD_REQUEST or PARSE_TOO_MANY_FIELDS.
+ssize_t	parse_http_request(char *buf, size_t len, http_request_t *request)
+{
+	size_t	pos = 0;
+	int		ret;
+
+	request->buf = buf;
+	request->header_count = 0;
+	memset(request->known_headers, 0, sizeof(request->known_headers));
+	memset(request->other_headers, 0, sizeof(request->other_headers));
+	// Request line: "<METHOD> <PATH> <VERSION>\r\n"
+	if ((ret = scan_token(buf, len, &pos, ' ', &request->method)) <= 0
+		|| (ret = scan_token(buf, len, &pos, ' ', &request->path)) <= 0)
+		return (ret == 0 ? PARSE_NEED_MORE : PARSE_BAD_REQUEST);
+	if (!scan_line(buf, len, &pos, &request->version))
+		return (PARSE_NEED_MORE);
+	if (request->method.len == 0 || request->path.len == 0 || request->version.len < 5
+		|| strncmp(buf + request->version.off, "HTTP/", 5) != 0)
+		return (PARSE_BAD_REQUEST);
+	// Header fields: "<NAME>: <VALUE>\r\n", until an empty line.
+	while (1)
 	{
-		http_field = string_cutter(string_cut_ptr2 + 2,string_cut_ptr1 = strstr(string_cut_ptr2 + 2, ":"));
-		if (http_field == NULL)
+		if (pos >= len)
+			return (PARSE_NEED_MORE);
+		if (buf[pos] == '\n' || buf[pos] == '\r')
 		{
-			free_http(http);
-			return (NULL);
+			if (buf[pos] == '\r' && pos + 1 >= len)
+				return (PARSE_NEED_MORE);
+			if (buf[pos] == '\r' && buf[pos + 1] != '\n')
+				return (PARSE_BAD_REQUEST);
+			pos += buf[pos] == '\r' ? 2 : 1;
+			break ;
 		}
-		http_val = string_cutter(string_cut_ptr1 + 2,string_cut_ptr2 = strstr(string_cut_ptr1 + 2, "\r\n"));
-		if (http_val == NULL)
+		if (request->header_count == MAX_REQUEST_HEADERS)
+			return (PARSE_TOO_MANY_FIELDS);
+		http_header_t	*header = &request->headers[request->header_count];
+		if ((ret = scan_token(buf, len, &pos, ':', &header->name)) <= 0)
+			return (ret == 0 ? PARSE_NEED_MORE : PARSE_BAD_REQUEST);
+		if (header->name.len == 0 || buf[pos - 2] == ' ' || buf[pos - 2] == '\t')
+			return (PARSE_BAD_REQUEST);
+		if (!scan_line(buf, len, &pos, &header->val))
+			return (PARSE_NEED_MORE);
+		while (header->val.len > 0 && (buf[header->val.off] == ' ' || buf[header->val.off] == '\t'))
 		{
-			free(http_field);
-			free_http(http);
-			return (NULL);
+			header->val.off++;
+			header->val.len--;
 		}
-		if (add_field_to_http(http, http_field, http_val) == -1)
+		while (header->val.len > 0 && (buf[header->val.off + header->val.len - 1] == ' '
+			|| buf[header->val.off + header->val.len - 1] == '\t'))
+			header->val.len--;
+		index_request_header(request, request->header_count);
+		request->header_count++;
+	}
+	// Every view ends on a delimiter, which is not needed anymore.
+	buf[request->method.off + request->method.len] = '\0';
+	buf[request->path.off + request->path.len] = '\0';
+	buf[request->version.off + request->version.len] = '\0';
+	for (int i = 0; i < request->header_count; i++)
+	{
+		buf[request->headers[i].name.off + request->headers[i].name.len] = '\0';
+		buf[request->headers[i].val.off + request->headers[i].val.len] = '\0';
+	}
+	return (pos);
+}
+
+// Returns the value of a known header field of the request, or NULL if it does not exist.
+char	*request_header(http_request_t *request, header_id_t id)
+{
+	int	idx = request->known_headers[id];
+
+	return (idx ? request_str(request, request->headers[idx - 1].val) : NULL);
+}
+
+// Returns the value of the header field of the request, or NULL if it does not exist.
+// Header field names are case-insensitive.
+char	*find_request_header(http_request_t *request, char *name)
+{
+	size_t			len = strlen(name);
+	unsigned int	hash = hash_header_name(name, len);
+	header_id_t		id = intern_header_name(name, len, hash);
+
+	if (id != HDR_OTHER)
+		return (request_header(request, id));
+	for (unsigned int slot = hash & (OTHER_HEADER_SLOTS - 1); request->other_headers[slot] != 0;
+		slot = (slot + 1) & (OTHER_HEADER_SLOTS - 1))
+	{
+		http_header_t	*header = &request->headers[request->other_headers[slot] - 1];
+		if (header->name.len == len && strncasecmp(request->buf + header->name.off, name, len) == 0)
+			return (request_str(request, header->val));
+	}
+	return (NULL);
+}
+
+// Same format as print_http_header().
+void	print_http_request(http_request_t *request)
+{
+	int		longest_element = 11;
+	int		longest_field = 0;
+	char	int_str[32];
+
+	for (int i = 0; i < request->header_count; i++)
+		if ((int)request->headers[i].name.len > longest_field)
+			longest_field = request->headers[i].name.len;
+	print_tuple_yellow ("METHOD", request_str(request, request->method), longest_element, 2);
+	print_tuple_yellow ("PATH", request_str(request, request->path), longest_element, 2);
+	print_tuple_yellow ("VERSION", request_str(request, request->version), longest_element, 2);
+	print_tuple_yellow ("STATUS", NULL, longest_element, 2);
+	print_tuple_yellow ("BODY SIZE", "0", longest_element, 2);
+	sprintf(int_str, "%d", request->header_count);
+	print_tuple_yellow ("FIELD COUNT", int_str, longest_element, 2);
+	YELLOW_PRTF ("\t\tFIELDS:\n");
+	for (int i = 0; i < request->header_count; i++)
+		print_tuple_yellow (request_str(request, request->headers[i].name),
+			request_str(request, request->headers[i].val), longest_field, 3);
+}
+
+// Builds an http struct from a request header, with parse_http_request() on a copy of header_str.
+// The server itself works on the parsed request in place.
+http_t *parse_http_header (char *header_str)
+{
+	http_request_t	request;
+	char			*buf = copy_string(header_str);
+
+	if (buf == NULL || parse_http_request(buf, strlen(buf), &request) <= 0)
+	{
+		free(buf);
+		return (NULL);
+	}
+	http_t	*http = init_http_with_arg(request_str(&request, request.method), request_str(&request, request.path),
+		request_str(&request, request.version), "");
+	if (http == NULL)
+	{
+		free(buf);
+		return (NULL);
+	}
+	free(http->status);
+	http->status = NULL;
+	for (int i = 0; i < request.header_count; i++)
+	{
+		if (add_field_to_http(http, request_str(&request, request.headers[i].name),
+			request_str(&request, request.headers[i].val)) == -1)
 		{
-			free(http_field);
-			free(http_val);
+			free(buf);
 			free_http(http);
 			return (NULL);
 		}
-		free(http_field);
-		free(http_val);
 	}
-    return http;
+	free(buf);
+	return (http);
 }
 
-// TODO: Initialize server socket and serve incoming connections, using server_routine.
-// HINT: Refer to the implementations in socket_util.c from the previous project.
-int server_engine (int server_port)
+// Returns the size of the status line and header fields of the http struct, blank line included.
+size_t	http_header_size(http_t *http)
 {
-    int server_listening_sock = -1;
-    // TODO: Initialize server socket
-	server_listening_sock = socket(AF_INET, SOCK_STREAM, 0);
-    // TODO: Set socket options to reuse the port immediately after the connection is closed
-	int	reuse = 1;
-	setsockopt(server_listening_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int));
-    // TODO: Bind server socket to the given port
-    struct sockaddr_in server_addr_info;
-	server_addr_info.sin_family = AF_INET;
-	server_addr_info.sin_port = htons(62123);
-	server_addr_info.sin_addr.s_addr = INADDR_ANY;
-	int	server_bind = bind(server_listening_sock, (struct sockaddr*)&server_addr_info, sizeof(server_addr_info));
-	if (server_bind == -1)
+	size_t	size = strlen(http->version) + 1 + (http->status ? strlen(http->status) : 0) + 2;
+
+	for (int i = 0; i < http->field_count; i++)
+		size += strlen(http->fields[i].field) + 2 + strlen(http->fields[i].val) + 2;
+	return (size + 2);
+}
+
+char	*append_str(char *dst, char *src)
+{
+	size_t	len = strlen(src);
+
+	memcpy(dst, src, len);
+	return (dst + len);
+}
+
+// Format the status line and header fields of the http struct to buffer in one pass, without the body.
+// Same format as write_http_to_buffer(). buffer must hold http_header_size() bytes, no '\0' is added.
+// Returns the number of bytes written.
+size_t	serialize_http_header(http_t *http, char *buffer)
+{
+	char	*end = buffer;
+
+	end = append_str(end, http->version);
+	*end++ = ' ';
+	end = append_str(end, http->status ? http->status : "");
+	end = append_str(end, "\r\n");
+	for (int i = 0; i < http->field_count; i++)
 	{
-        ERROR_PRTF ("SERVER ERROR: bind() error\n");
-		close(server_listening_sock);
-    	return -1;
+		end = append_str(end, http->fields[i].field);
+		end = append_str(end, ": ");
+		end = append_str(end, http->fields[i].val);
+		end = append_str(end, "\r\n");
 	}
-    // TODO: Listen for incoming connections
-	int server_listen = listen(server_listening_sock, MAX_WAITING_CONNECTIONS);
-	if (server_listen == -1)
+	end = append_str(end, "\r\n");
+	return (end - buffer);
+}
+
+// Format the status line and header fields of the http struct to a new '\0'-terminated buffer, without the body.
+// Returns number of bytes written if successful, -1 if not.
+ssize_t	write_http_header_to_buffer(http_t *http, void **buffer_ptr)
+{
+	char	*buffer = (char *)malloc(http_header_size(http) + 1);
+
+	if (buffer == NULL)
 	{
-        ERROR_PRTF ("SERVER ERROR: listen() error\n");
-		close(server_listening_sock);
-    	return -1;
-	}
-    // Serve incoming connections forever
-    while (1)
-    {
-        struct sockaddr_in client_addr_info;
-        socklen_t client_addr_info_len = sizeof(client_addr_info);
-        int client_connected_sock = -1;
-
-        // TODO: Accept incoming connections
-		client_connected_sock = accept(server_listening_sock, (struct sockaddr*)&client_addr_info, &client_addr_info_len);
-		char	client_ip[INET_ADDRSTRLEN];
-		unsigned int	client_port = ntohs(client_addr_info.sin_port);
-		inet_ntop(AF_INET, &(client_addr_info.sin_addr), client_ip, INET_ADDRSTRLEN);
-		printf ("CLIENT %s:%u ", client_ip, client_port);
-		GREEN_PRTF ("CONNECTED.\n");
-        // Serve the client
-        server_routine (client_connected_sock);
-        
-        // TODO: Close the connection with the client
-		printf ("CLIENT %s:%u ", client_ip, client_port);
-		GREEN_PRTF ("DISCONNECTED.\n\n");
-		close(client_connected_sock);
-    }
+		ERROR_PRTF ("SERVER ERROR: Failed to allocate HTTP response header\n");
+		return (-1);
+	}
+	size_t	buffer_size = serialize_http_header(http, buffer);
+	buffer[buffer_size] = '\0';
+	*buffer_ptr = buffer;
+	return (buffer_size);
+}
 
-    // TODO: Close the server socket
-	close(server_listening_sock);
-    return 0;
+// Format date as an HTTP date ("Sun, 06 Nov 1994 08:49:37 GMT") into buffer (at least 30 bytes).
+void	format_http_date(time_t date, char *buffer)
+{
+	struct tm	tm;
+
+	strftime(buffer, 30, "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&date, &tm));
 }
 
-// TODO: Implement server routine for HTTP/1.0.
-//       Return -1 if error occurs, 0 otherwise.
-// HINT: Your implementation will be MUCH EASIER if you use the functions & structs provided in http_util.c.
-//       Please read the descriptions in http_functions.h and the function definitions in http_util.c,
-//       and use the provided functions as much as possible!
-//       Also, please read https://en.wikipedia.org/wiki/List_of_HTTP_header_fields to get a better understanding
-//       on how the structure and protocol of HTTP messages are defined.
-int server_routine (int client_sock)
+// Parse an HTTP date in the preferred format into *date.
+// Returns 0 if successful, -1 if str is not one.
+int	parse_http_date(char *str, time_t *date)
 {
-    if (client_sock == -1)
-        return -1;
-
-    size_t bytes_received = 0;
-    char *http_version = "HTTP/1.0"; // We will only support HTTP/1.0 in this project.
-    char header_buffer[MAX_HTTP_MSG_HEADER_SIZE] = {0};
-    int header_too_large_flag = 0;
-    http_t *response = NULL, *request = NULL;
-
-    // TODO: Receive the HEADER of the client http message.
-    //       You have to consider the following cases:
-    //       1. End of header delimiter is received (HINT: https://en.wikipedia.org/wiki/List_of_HTTP_header_fields)
-    //       2. Error occurs on read() (i.e. read() returns -1)
-    //       3. Client disconnects (i.e. read() returns 0)
-    //       4. MAX_HTTP_MSG_HEADER_SIZE is reached (i.e. message is too long)
-	// bytes_received = send(client_sock, header_buffer, MAX_HTTP_MSG_HEADER_SIZE, 0);
-	bytes_received = read(client_sock, header_buffer, MAX_HTTP_MSG_HEADER_SIZE);
-	if (bytes_received < 0)
-	{
-        ERROR_PRTF ("SERVER ERROR: Failed to read HTTP request header\n");
-        return -1;
-	}
-	if (bytes_received >= MAX_HTTP_MSG_HEADER_SIZE)
-		header_too_large_flag = -1;
-
-    // while (1)
-    // {
-    //     // Remove this line and implement the logic described above.
-    //     header_too_large_flag = 1;
-    //     break;
-    // }
-
-    // Send different http response depending on the request.
-    // Carefully follow the four cases and their TODOs described below.
-    // HINT: Please refer to https://developer.mozilla.org/en-US/docs/Web/HTTP/Status for more information on HTTP status codes.
-    //       We will be using code 200, 400, 401, 404, and 431 in this project.
-
-    // Case 1: If the received header message is too large... 
-    // TODO: Send 431 Request Header Fields Too Large. (IMPLEMENTED)
-    // HINT: In most real-world web browsers, this error rarely occurs.
-    //       However, we implemented this case to give you a HINT on how to use the included functions in http_util.c.
-
-    if (header_too_large_flag)
-    {
-        // Create the response, with the appropriate status code and http version.
-        // Refer to http_util.c for more details.
-        response = init_http_with_arg (NULL, NULL, http_version, "431");
-        if (response == NULL)
-        {
-            ERROR_PRTF ("SERVER ERROR: Failed to create HTTP response\n");
-            return -1;
-        }
-        // Add the appropriate fields to the header of the response.
-        add_field_to_http (response, "Content-Type", "text/html");
-        add_field_to_http (response, "Connection", "close");
-
-        // Generate and add the body of the response.
-        char body[] = "<html><body><h1>431 Request Header Fields Too Large</h1></body></html>";
-        add_body_to_http (response, sizeof(body), body);
-    }
-    else
-    {
-        // We have successfully received the header of the client http message.
-        // TODO: Parse the header of the client http message.
-        // HINT: Implement and use parse_http_header() function to format the received http message into a struct.
-        //       You are NOT REQUIRED to implement and use parse_http_header().
-        //       However, if you do, you will be able to use the http struct and its member functions,
-        //       which will make things MUCH EASIER for you. We highly recommend you to do so.
-
-        request = parse_http_header (header_buffer); // TODO: Change this to your implementation.
-		if (request == NULL)
-		{
-			ERROR_PRTF ("SERVER ERROR: Failed to receive HTTP request\n");
-			return -1;
-		}
-		printf ("\tHTTP ");
-		GREEN_PRTF ("REQUEST:\n");
-		print_http_header (request);
-
-        // We must behave differently depending on the type of the request.
-        if (strncmp (request->method, "GET", 3) == 0)
-        {
-            // Case 2: GET request is received.
-            // HINT: It is common to return index.html when the client requests a directory.
-
-            // TODO: First check if the requested file needs authorization. If so, check if the client is authorized.
-            // HINT: The client will send the ID and password in BASE64 encoding in the Authorization header field, 
-            //       in the format of "Basic <ID:password>", where <ID:password> is encoded in BASE64.
-            //       Refer to https://developer.mozilla.org/ko/docs/Web/HTTP/Authentication for more information.
-            int auth_flag = 0;
-            char *auth_list[] = {"/secret.html", "/public/images/khl.jpg"};
-            char ans_plain[] = "DCN:FALL2023"; // ID:password (Please do not change this.)
-			if (strstr(request->path, auth_list[0]) || strstr(request->path, auth_list[1]))
-			{
-				if (find_http_field_val(request, "Authorization") == NULL)
-					auth_flag = 1;
-				else
-				{
-					char	*input_auth = strchr(find_http_field_val(request, "Authorization"), ' ');
-					if (input_auth != NULL)
-						input_auth += 1;
-					size_t	max_decode_len = strlen(input_auth);
-					char	*encode_ans = base64_encode(ans_plain, max_decode_len);
-					printf("%s\n", encode_ans);
-					if (strncmp(input_auth, encode_ans, max_decode_len) != 0)
-						auth_flag = 1;
-				}
-			}
+	struct tm	tm;
 
-			char *file_path = (char *)malloc(MAX_PATH_SIZE);
-			file_path = strcpy(file_path, SERVER_ROOT);
-			void *content = NULL;
-			file_path = strcat(file_path, request->path);
-			if (strcmp(request->path, "/") == 0)
-				file_path = strcat(file_path, "index.html");
-			ssize_t	body_size = read_file(&content, file_path);
-            // Case 2-1: If authorization succeeded...
-            // TODO: Get the file path from the request.
-			if (auth_flag == 0)
-			{
-                // Case 2-1-1: If the file does not exist...
-                // TODO: Send 404 Not Found.
-				if (body_size < 0)
-				{
-					response = init_http_with_arg (NULL, NULL, http_version, "404");
-					if (response == NULL)
-					{
-						ERROR_PRTF ("SERVER ERROR: Failed to create HTTP response\n");
-						free(file_path);
-						free(content);
-						return -1;
-					}
-					add_field_to_http (response, "Content-Type", "text/html");
-					add_field_to_http (response, "Connection", "close");
-        			char body[] = "<html><body><h1>404 Not Found</h1></body></html>";
-					add_body_to_http (response, sizeof(body), body);
-				}
-                // Case 2-1-2: If the file exists...
-                // TODO: Send 200 OK with the file as the body.
-				else
-				{
-					response = init_http_with_arg (NULL, NULL, http_version, "200");
-					if (response == NULL)
-					{
-						ERROR_PRTF ("SERVER ERROR: Failed to create HTTP response\n");
-						free(file_path);
-						free(content);
-						return -1;
-					}
-					char	*file_extention = get_file_extension(file_path);
-					char	*body_type = find_content_type(file_extention, find_http_field_val(request, "Accept"));
-					add_body_to_http (response, (size_t)body_size, content);
-					add_field_to_http (response, "Connection", "close");
-					add_field_to_http (response, "Content-Type", body_type);
-				}
-			}
-            // Case 2-2: If authorization failed...
-            // TODO: Send 401 Unauthorized with WWW-Authenticate field set to Basic.
-            //       Refer to https://developer.mozilla.org/ko/docs/Web/HTTP/Authentication for more information.
-			else
-			{
-				response = init_http_with_arg (NULL, NULL, http_version, "401");
-				if (response == NULL)
-				{
-					ERROR_PRTF ("SERVER ERROR: Failed to create HTTP response\n");
-					free(file_path);
-					free(content);
-					return -1;
-				}
-				add_field_to_http (response, "Content-Type", "text/html");
-				add_field_to_http (response, "Connection", "close");
-        		char body[] = "<html><body><h1>401 Unauthorized</h1></body></html>";
-				add_body_to_http (response, sizeof(body), body);
-				add_field_to_http (response, "WWW-Authenticate", "Basic realm=\"ID & Password?\"");
-			}
-			free(file_path);
-			free(content);
-        }
-        else if (strncmp (request->method, "POST", 4) == 0)
-        {
-	printf("%s\n", header_buffer);
-            // Case 3: POST request is received.
-            // TODO: Receive the body of the POST http message.
-            // HINT: Use the Content-Length & boundary in Content-type field in the header to determine 
-            //       the start & the size of the body.
-            //       Also, there might be some parts of the body that were received along with the header...
-            //       Refer to https://developer.mozilla.org/en-US/docs/Web/HTTP/Methods/POST for more information.
-
-            // TODO: Parse each request_body of the multipart content request_body.			
-			http_t	*request_body = NULL;
-			char	body_buffer[MAX_HTTP_MSG_HEADER_SIZE];
-			int		request_body_size;
-			request_body_size = read(client_sock, body_buffer, MAX_HTTP_MSG_HEADER_SIZE);
-			if (request_body_size < 0)
-			{
-				ERROR_PRTF ("SERVER ERROR: Failed to read HTTP request body.\n");
-				return -1;
-			}
-			size_t	request_body_len = request_body_size;
-			request_body = init_http();
-			if (request_body == NULL)
-			{
-				ERROR_PRTF ("SERVER ERROR: Failed to receive HTTP post request.\n");
-				return -1;
-			}
-			char	*boundary = strstr(find_http_field_val(request, "Content-Type"), "boundary=");
-			if (boundary != NULL)
-				boundary += strlen("boundary=");
-			char	*parsing_ptr1 = strstr(body_buffer, boundary);
-			parsing_ptr1 += strlen(boundary);
-			char	*parsing_ptr2;
-			char	*parsing_body_field;
-			char	*parsing_body_val;
-			int		body_sucesser;
-			while (strstr(parsing_ptr1, ":") != NULL)
-			{
-				parsing_body_field = string_cutter(parsing_ptr1 + 2, parsing_ptr2 = strstr(parsing_ptr1, ":"));
-				parsing_body_val = string_cutter(parsing_ptr2 + 2, parsing_ptr1 = strstr(parsing_ptr2, "\r\n"));
-				body_sucesser = add_field_to_http(request_body, parsing_body_field, parsing_body_val);
-				free(parsing_body_field);
-				free(parsing_body_val);
-			}
-            // TODO: Get the filename of the file.
-			parsing_ptr1 = strstr(find_http_field_val(request_body, "Content-Disposition"), "filename=\"");
-			parsing_ptr1 += strlen("filename=\"");
-			parsing_ptr2 = strstr(parsing_ptr1, "\"");
-			char	*filename = string_cutter(parsing_ptr1, parsing_ptr2);
-			char	*file_extension = get_file_extension(filename);
-			char	*content_finder[MAX_HTTP_MSG_HEADER_SIZE];
-			int		content_len = atoi(find_http_field_val(request, "Content-Length"));
-			void	*file_content = calloc(content_len + 1, sizeof(char));
-			int		readed_len = read_bytes(client_sock, file_content, content_len);
-			
-			// int		content_find_len;
-			// int		readed_len = 0;
-			// content_find_len = read(client_sock, content_finder, MAX_HTTP_MSG_HEADER_SIZE);
-			// while (content_find_len == MAX_HTTP_MSG_HEADER_SIZE)
-			// {
-			// 	file_content = strcat(file_content, (const char *)content_finder);
-			// 	readed_len += content_find_len;
-			// 	content_find_len = read(client_sock, content_finder, MAX_HTTP_MSG_HEADER_SIZE);
-			// }
-			// if (readed_len != content_len)
-			// {
-			// 	ERROR_PRTF ("SERVER ERROR: Failed to receive HTTP post content.\n");
-			// 	return -1;
-			// }
-			// parsing_ptr2 = parsing_ptr1 + 2 + atoi(find_http_field_val(request, "Content-Length"));
-			// parsing_ptr2 = parsing_ptr1 + atoi(find_http_field_val(request, "Content-Length"));
-			// parsing_ptr1 = strlcpy(parsing_ptr1, content_finder, content_find_len + 1);
-			// parsing_ptr2 = strstr(content_finder, boundary);
-			// file_content = memcpy(file_content, content_finder, content_find_len);
-			// file_content = strcpy(file_content, content_finder);
-
-			printf ("\tHTTP ");
-			GREEN_PRTF ("POST BODY:\n");
-			body_sucesser = add_body_to_http(request_body, sizeof((void *)file_content), file_content);
-			print_http_header (request_body);
-            // TODO: Check if the file is an image file.
-			if (strncmp(file_extension, "jpg", 3) != 0)
-			{
-				ERROR_PRTF ("SERVER ERROR: Invalid file type\n");
-				free_http (request);
-				free_http (request_body);
-				return -1;
-			}
-            // TODO: Save the file in the album.
-			// char	*write_path = (char *)calloc(MAX_PATH_SIZE, sizeof(char));
-			// write_path = strcat(write_path, SERVER_ROOT);
-			// write_path = strcat(write_path, ALBUM_PATH);
-			// char	*write_path = (char *)calloc(strlen(ALBUM_HTML_PATH) + 1, sizeof(char));
-			// write_path = strcat(write_path, ALBUM_HTML_PATH);
-			// ssize_t	file_size = write_file(write_path, file_content, sizeof(file_content));
-			// free(write_path);
-			// if (file_size == -1)
-			// {
-            // 	ERROR_PRTF ("SERVER ERROR: Failed to write file to album_images.html\n");
-			// 	free_http (request);
-			// 	free_http (request_body);
-			// 	return -1;
-			// }
-            // Append the appropriate html for the new image to album.html.
-            // char filename[MAX_PATH_SIZE] = filename;
-            size_t html_append_size = strlen (ALBUM_HTML_TEMPLATE) + strlen (filename)*2 + 1;
-            char *html_append = (char *)calloc (1, html_append_size);
-            sprintf (html_append, ALBUM_HTML_TEMPLATE, filename, filename);
-            append_file (ALBUM_HTML_PATH , html_append, strlen (html_append));
-            free (html_append);
-			// add_body_to_http (response, (size_t)file_size, file_content);
-
-            // TODO: Respond with a 200 OK.
-			char *file_path = (char *)malloc(MAX_PATH_SIZE);
-			file_path = strcpy(file_path, SERVER_ROOT);
-			void *content = NULL;
-			file_path = strcat(file_path, request->path);
-			if (strcmp(request->path, "/") == 0)
-				file_path = strcat(file_path, "index.html");
-			ssize_t	body_size = read_file(&content, file_path);
-			response = init_http_with_arg (NULL, NULL, http_version, "200");
-			if (response == NULL)
-			{
-				ERROR_PRTF ("SERVER ERROR: Failed to create HTTP response\n");
-				free(file_path);
-				free(content);
-				return -1;
-			}
-			char	*file_extention = get_file_extension(file_path);
-        	// char body[] = "<html><body><h1>POST Image</h1></body></html>";
-			char	*body_type = find_content_type(file_extention, find_http_field_val(request, "Accept"));
-			add_body_to_http (response, (size_t)body_size, content);
-			add_field_to_http (response, "Connection", "close");
-			add_field_to_http (response, "Content-Type", body_type);
-			// char	*body_type = find_content_type(file_ext, find_http_field_val(request, "Accept"));
-        }
-        else
-        {
-            // Case 4: Other requests...
-            // TODO: Send 400 Bad Request.
-			response = init_http_with_arg (NULL, NULL, http_version, "400");
-			if (response == NULL)
-			{
-				ERROR_PRTF ("SERVER ERROR: Failed to create HTTP response\n");
-				return -1;
-			}
-			add_field_to_http (response, "Content-Type", "text/html");
-			add_field_to_http (response, "Connection", "close");
-      			char body[] = "<html><body><h1>404 Bad Request</h1></body></html>";
-			add_body_to_http (response, sizeof(body), body);
-        }
-    }
-
-    // Send the response to the client.
-    if (response != NULL)
-    {
-        printf ("\tHTTP ");
-        GREEN_PRTF ("RESPONSE:\n");
-        print_http_header (response);
-
-        // Parse http response to buffer
-        void *response_buffer = NULL;
-        ssize_t response_size = write_http_to_buffer (response, &response_buffer);
-        if (response_size == -1)
-        {
-            ERROR_PRTF ("SERVER ERROR: Failed to write HTTP response to buffer\n");
-            free_http (request);
-            free_http (response);
-            return 0;
-        }
-
-        // Send http response to client
-        if (write_bytes (client_sock, response_buffer, response_size) == -1)
-        {
-            ERROR_PRTF ("SERVER ERROR: Failed to send response to client\n");
-            free (response_buffer);
-            free_http (request);
-            free_http (response);
-            return 0;
-        }
-
-        free (response_buffer);
-    }
-    free_http (request);
-    free_http (response);
-    return 0;
+	memset(&tm, 0, sizeof(tm));
+	char	*end = strptime(str, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	if (end == NULL || *end != '\0')
+		return (-1);
+	*date = timegm(&tm);
+	return (0);
+}
+
+// FNV-1a hash of a string.
+unsigned int	hash_string(char *str)
+{
+	unsigned int	hash = 2166136261u;
+
+	while (*str)
+	{
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+	return (hash);
+}
+
+// Content codings of the bodies of the responses, in order of preference after identity.
+typedef enum content_coding_t
+{
+	CODING_IDENTITY,
+	CODING_BR,
+	CODING_GZIP,
+	CODING_COUNT
+}	content_coding_t;
+
+char	*g_coding_names[CODING_COUNT] = {"identity", "br", "gzip"};
+// Suffix of the precompressed sidecar of a file in each coding, made ahead of time next to the file.
+char	*g_coding_suffixes[CODING_COUNT] = {"", ".br", ".gz"};
+
+// An open static file, with the metadata it had when it was opened or last checked.
+// Shared by the open file cache and the responses that send from it, closed with the last reference.
+typedef struct open_file_t
+{
+	char				*path; // Path built from the request, the key of the entry.
+	char				*real_path; // Canonical path of the file, with every symlink and "." or ".." resolved.
+	int					fd;
+	off_t				size;
+	time_t				mtime;
+	dev_t				dev;
+	ino_t				ino;
+	size_t				validated_msec; // Last time the entry was checked with stat().
+	size_t				last_used_msec;
+	int					refcount; // One for the cache while the entry is in it, one per user.
+	char				etag[64]; // Strong validator of this version of the file, from its inode, size and mtime.
+	char				last_modified[32]; // mtime as an HTTP date.
+	int					sidecars; // Mask (1 << coding) of the precompressed sidecars found when the file was checked.
+	int					fixed_slot; // Slot of fd in the fixed file table of the io_uring engine, -1 if none.
+	int					no_sendfile; // sendfile() failed for the file, so its bytes are copied through a chunk buffer.
+	struct open_file_t	*hash_next;
+	struct open_file_t	*lru_prev; // Neighbours in the LRU list, most recently used first.
+	struct open_file_t	*lru_next;
+}	open_file_t;
+
+// Open file cache of a worker, bounded to g_config.fd_cache_max entries.
+typedef struct fd_cache_t
+{
+	open_file_t	*buckets[FD_CACHE_BUCKETS];
+	open_file_t	*lru_head;
+	open_file_t	*lru_tail;
+	size_t		entry_count;
+	size_t		hits;
+	size_t		misses;
+}	fd_cache_t;
+
+fd_cache_t	g_fd_cache;
+
+#ifdef HAVE_IO_URING
+// Operations submitted to the io_uring, stored in the low bits of their user_data, above them the connection.
+typedef enum uring_op_t
+{
+	URING_ACCEPT, // Multishot accept on the listening socket.
+	URING_IO_POOL, // Multishot poll of the eventfd of the I/O pool.
+	URING_RECV, // Multishot receive of a connection, into the buffers of the ring.
+	URING_SEND, // Send of the queued responses of a connection.
+	URING_SPLICE, // Splice of a chunk of a file body into the pipe of a connection, linked to its send.
+	URING_CLOSE, // Close of the socket of a connection, linked to its last send.
+	URING_CANCEL, // Cancellation of the receive of a connection.
+	URING_POLL, // Poll of the socket of a connection whose upload is spliced from it by the I/O pool.
+	URING_OP_MASK = 7
+}	uring_op_t;
+
+// The io_uring of a worker, mapped from the kernel, with its ring of receive buffers and its fixed file table.
+typedef struct uring_t
+{
+	int							fd; // -1 if the worker does not run the io_uring engine.
+	int							listening_sock;
+	void						*ring_map;
+	size_t						ring_map_size;
+	unsigned int				*sq_head;
+	unsigned int				*sq_tail;
+	unsigned int				*sq_array;
+	unsigned int				sq_mask;
+	unsigned int				sq_entries;
+	unsigned int				sq_local_tail; // Tail including the SQEs filled but not published yet.
+	struct io_uring_sqe			*sqes;
+	unsigned int				*cq_head;
+	unsigned int				*cq_tail;
+	unsigned int				cq_mask;
+	struct io_uring_cqe			*cqes;
+	struct io_uring_buf_ring	*buf_ring;
+	char						*buffers; // URING_BUFFER_COUNT buffers of URING_BUFFER_SIZE bytes.
+	unsigned short				buf_tail;
+	int							free_buffers; // Buffers in the ring, that the kernel can receive into.
+	int							buf_next[URING_BUFFER_COUNT]; // Next buffer held by the same connection, -1 if last.
+	unsigned int				buf_len[URING_BUFFER_COUNT];
+	int							*free_slots; // Free slots of the fixed file table.
+	int							free_slot_count;
+	struct conn_t				*starved; // Connections whose receive the loop arms again, once it has buffers to receive into.
+	size_t						enters;
+	size_t						completions;
+}	uring_t;
+
+uring_t	g_uring = {-1};
+#endif
+
+// Returns 1 if the worker serves its connections with the io_uring engine, 0 if not.
+int	uring_running()
+{
+#ifdef HAVE_IO_URING
+	return (g_uring.fd != -1);
+#else
+	return (0);
+#endif
+}
+
+#ifdef HAVE_IO_URING
+
+int	uring_enter(unsigned int to_submit, unsigned int min_complete, unsigned int flags, void *arg, size_t arg_size)
+{
+	g_uring.enters++;
+	return (syscall(__NR_io_uring_enter, g_uring.fd, to_submit, min_complete, flags, arg, arg_size));
+}
+
+int	uring_register(unsigned int opcode, void *arg, unsigned int nr_args)
+{
+	return (syscall(__NR_io_uring_register, g_uring.fd, opcode, arg, nr_args));
+}
+
+// Returns the number of SQEs filled and not consumed by the kernel yet, making them visible to it.
+unsigned int	uring_publish()
+{
+	__atomic_store_n(g_uring.sq_tail, g_uring.sq_local_tail, __ATOMIC_RELEASE);
+	return (g_uring.sq_local_tail - __atomic_load_n(g_uring.sq_head, __ATOMIC_ACQUIRE));
+}
+
+// Make room for count SQEs, submitting the ones already filled if the submission queue is full.
+// Returns 1 if there is room, 0 if not.
+int	uring_reserve(unsigned int count)
+{
+	unsigned int	pending = uring_publish();
+
+	if (g_uring.sq_entries - pending >= count)
+		return (1);
+	uring_enter(pending, 0, 0, NULL, 0);
+	return (g_uring.sq_entries - uring_publish() >= count);
+}
+
+// Fill the next SQE with an operation of opcode on fd, for the connection (NULL for the listening socket
+// and the I/O pool). uring_reserve() must have made room for it.
+struct io_uring_sqe	*uring_prep(int opcode, int fd, struct conn_t *conn, uring_op_t op)
+{
+	unsigned int		idx = g_uring.sq_local_tail & g_uring.sq_mask;
+	struct io_uring_sqe	*sqe = &g_uring.sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = (uintptr_t)conn | op;
+	g_uring.sq_array[idx] = idx;
+	g_uring.sq_local_tail++;
+	return (sqe);
+}
+
+// Give the buffer back to the kernel, to receive into again.
+void	uring_recycle_buffer(int bid)
+{
+	struct io_uring_buf	*buf = &g_uring.buf_ring->bufs[g_uring.buf_tail & (URING_BUFFER_COUNT - 1)];
+
+	buf->addr = (uintptr_t)(g_uring.buffers + (size_t)bid * URING_BUFFER_SIZE);
+	buf->len = URING_BUFFER_SIZE;
+	buf->bid = bid;
+	g_uring.buf_tail++;
+	__atomic_store_n(&g_uring.buf_ring->tail, g_uring.buf_tail, __ATOMIC_RELEASE);
+	g_uring.free_buffers++;
+}
+
+// Empty the slot of the fixed file table of an open file that is closed.
+void	uring_release_fixed_file(int slot)
+{
+	int								fd = -1;
+	struct io_uring_rsrc_update2	update;
+
+	memset(&update, 0, sizeof(update));
+	update.offset = slot;
+	update.data = (uintptr_t)&fd;
+	update.nr = 1;
+	if (uring_register(IORING_REGISTER_FILES_UPDATE2, &update, sizeof(update)) == 1)
+		g_uring.free_slots[g_uring.free_slot_count++] = slot;
+}
+#endif
+
+void	open_file_release(open_file_t *file)
+{
+	if (file == NULL || --file->refcount > 0)
+		return ;
+#ifdef HAVE_IO_URING
+	if (file->fixed_slot != -1)
+		uring_release_fixed_file(file->fixed_slot);
+#endif
+	close(file->fd);
+	free (file->path);
+	free (file->real_path);
+	free (file);
+}
+
+// Remove the entry from the cache. Responses still sending from it keep it open until they are done.
+void	fd_cache_remove(open_file_t *file)
+{
+	open_file_t	**link = &g_fd_cache.buckets[hash_string(file->path) % FD_CACHE_BUCKETS];
+
+	while (*link != file)
+		link = &(*link)->hash_next;
+	*link = file->hash_next;
+	if (file->lru_prev)
+		file->lru_prev->lru_next = file->lru_next;
+	else
+		g_fd_cache.lru_head = file->lru_next;
+	if (file->lru_next)
+		file->lru_next->lru_prev = file->lru_prev;
+	else
+		g_fd_cache.lru_tail = file->lru_prev;
+	g_fd_cache.entry_count--;
+	open_file_release(file);
+}
+
+void	fd_cache_push_front(open_file_t *file)
+{
+	file->lru_prev = NULL;
+	file->lru_next = g_fd_cache.lru_head;
+	if (g_fd_cache.lru_head)
+		g_fd_cache.lru_head->lru_prev = file;
+	else
+		g_fd_cache.lru_tail = file;
+	g_fd_cache.lru_head = file;
+}
+
+open_file_t	*fd_cache_find(char *path)
+{
+	open_file_t	*file = g_fd_cache.buckets[hash_string(path) % FD_CACHE_BUCKETS];
+
+	while (file != NULL && strcmp(file->path, path) != 0)
+		file = file->hash_next;
+	return (file);
+}
+
+// Close the files that were not used for g_config.fd_cache_inactive_msec.
+void	fd_cache_expire(size_t now)
+{
+	while (g_fd_cache.lru_tail != NULL && now - g_fd_cache.lru_tail->last_used_msec >= g_config.fd_cache_inactive_msec)
+		fd_cache_remove(g_fd_cache.lru_tail);
+}
+
+// Returns the mask (1 << coding) of the precompressed sidecars of the file at path, modified at mtime,
+// for the compressible types. A sidecar older than the file was made from a previous version, and is not used.
+int	find_sidecars(char *path, time_t mtime)
+{
+	int	sidecars = 0;
+
+	if (!is_compressible_type(get_file_extension(path)))
+		return (0);
+	for (int coding = CODING_IDENTITY + 1; coding < CODING_COUNT; coding++)
+	{
+		char		sidecar_path[MAX_PATH_SIZE + 8];
+		struct stat	sidecar_stat;
+		snprintf(sidecar_path, sizeof(sidecar_path), "%s%s", path, g_coding_suffixes[coding]);
+		if (stat(sidecar_path, &sidecar_stat) == 0 && S_ISREG(sidecar_stat.st_mode) && sidecar_stat.st_mtime >= mtime)
+			sidecars |= 1 << coding;
+	}
+	return (sidecars);
+}
+
+// Open the regular file at path, and resolve its canonical path.
+// Returns a new entry with one reference for the caller, NULL if the file does not exist or an error occurs.
+open_file_t	*open_file(char *path)
+{
+	struct stat	file_stat;
+	int			fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd == -1)
+		return (NULL);
+	if (fstat(fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode))
+	{
+		close(fd);
+		return (NULL);
+	}
+	open_file_t	*file = (open_file_t *)calloc(1, sizeof(open_file_t));
+	if (file == NULL)
+	{
+		ERROR_PRTF ("SERVER ERROR: Failed to allocate open file\n");
+		close(fd);
+		return (NULL);
+	}
+	file->fd = fd;
+	file->fixed_slot = -1;
+	file->refcount = 1;
+	file->path = strdup(path);
+	file->real_path = realpath(path, NULL);
+	if (file->path == NULL || file->real_path == NULL)
+	{
+		ERROR_PRTF ("SERVER ERROR: Failed to resolve %s\n", path);
+		open_file_release(file);
+		return (NULL);
+	}
+	file->size = file_stat.st_size;
+	file->mtime = file_stat.st_mtime;
+	file->dev = file_stat.st_dev;
+	file->ino = file_stat.st_ino;
+	file->validated_msec = get_time_msec();
+	sprintf(file->etag, "\"%llx-%llx-%llx\"", (unsigned long long)file->ino, (unsigned long long)file->size,
+		(unsigned long long)file->mtime);
+	format_http_date(file->mtime, file->last_modified);
+	file->sidecars = find_sidecars(file->path, file->mtime);
+	return (file);
+}
+
+// What fd_cache_open() has to do on disk for a path, and what it found there.
+// The disk part is done by check_file(), which only uses this structure, so that the I/O pool can run it.
+typedef struct file_check_t
+{
+	char		path[MAX_PATH_SIZE + 8];
+	open_file_t	*cached; // Entry to check, with a reference held until the check is done. NULL to open the file.
+	dev_t		dev; // Metadata of cached.
+	ino_t		ino;
+	off_t		size;
+	time_t		mtime;
+	int			unchanged; // cached is still up to date.
+	int			sidecars; // Sidecars of cached, if it is.
+	open_file_t	*file; // File opened if there was no up to date entry, with one reference. NULL if it does not exist.
+}	file_check_t;
+
+// Move the file to the front of the LRU list if it is in the cache, and take a reference for the caller.
+open_file_t	*fd_cache_use(open_file_t *file, size_t now)
+{
+	if (file != g_fd_cache.lru_head && fd_cache_find(file->path) == file)
+	{
+		file->lru_prev->lru_next = file->lru_next;
+		if (file->lru_next)
+			file->lru_next->lru_prev = file->lru_prev;
+		else
+			g_fd_cache.lru_tail = file->lru_prev;
+		fd_cache_push_front(file);
+	}
+	file->last_used_msec = now;
+	file->refcount++;
+	return (file);
+}
+
+// Start fd_cache_open() for path: find its entry, and if it needs to be checked or opened, fill check with what
+// check_file() has to do. Returns 1 with *file set if the entry is up to date, 0 if check_file() is needed.
+int	fd_cache_begin(char *path, file_check_t *check, open_file_t **file)
+{
+	size_t	now = get_time_msec();
+
+	fd_cache_expire(now);
+	*file = fd_cache_find(path);
+	if (*file != NULL && now - (*file)->validated_msec < g_config.cache_ttl_msec)
+	{
+		g_fd_cache.hits++;
+		fd_cache_use(*file, now);
+		return (1);
+	}
+	snprintf(check->path, sizeof(check->path), "%s", path);
+	check->cached = *file;
+	check->unchanged = 0;
+	check->file = NULL;
+	if (*file != NULL)
+	{
+		(*file)->refcount++;
+		check->dev = (*file)->dev;
+		check->ino = (*file)->ino;
+		check->size = (*file)->size;
+		check->mtime = (*file)->mtime;
+	}
+	return (0);
+}
+
+// Check with stat() that the cached file did not change, or open the file.
+void	check_file(file_check_t *check)
+{
+	struct stat	file_stat;
+
+	if (check->cached != NULL && stat(check->path, &file_stat) == 0 && file_stat.st_dev == check->dev
+		&& file_stat.st_ino == check->ino && file_stat.st_size == check->size && file_stat.st_mtime == check->mtime)
+	{
+		check->unchanged = 1;
+		check->sidecars = find_sidecars(check->path, check->mtime);
+		return ;
+	}
+	check->file = open_file(check->path);
+}
+
+// Finish fd_cache_open() with the result of check_file(): keep the checked entry, or replace it with the file opened.
+// Returns the file with one reference for the caller, NULL if it does not exist or an error occurs.
+open_file_t	*fd_cache_end(file_check_t *check)
+{
+	size_t		now = get_time_msec();
+	open_file_t	*file = check->cached;
+
+	if (check->unchanged)
+	{
+		g_fd_cache.hits++;
+		file->validated_msec = now;
+		file->sidecars = check->sidecars;
+		fd_cache_use(file, now);
+		open_file_release(file);
+		return (file);
+	}
+	g_fd_cache.misses++;
+	if (file != NULL)
+	{
+		if (fd_cache_find(check->path) == file)
+			fd_cache_remove(file);
+		open_file_release(file);
+	}
+	file = check->file;
+	if (file == NULL || g_config.fd_cache_max == 0)
+		return (file);
+	// Another check of the same path may have added it meanwhile.
+	open_file_t	*other = fd_cache_find(check->path);
+	if (other != NULL)
+		fd_cache_remove(other);
+	if (g_fd_cache.entry_count >= g_config.fd_cache_max)
+		fd_cache_remove(g_fd_cache.lru_tail);
+	unsigned int	bucket = hash_string(check->path) % FD_CACHE_BUCKETS;
+	file->hash_next = g_fd_cache.buckets[bucket];
+	g_fd_cache.buckets[bucket] = file;
+	fd_cache_push_front(file);
+	file->last_used_msec = now;
+	file->refcount++;
+	g_fd_cache.entry_count++;
+	return (file);
+}
+
+// Get the open file at path from the cache, or open it and add it to the cache.
+// A cached entry is checked with stat() once it is older than g_config.cache_ttl_msec,
+// and reopened if the file was replaced or modified.
+// Returns the file with one reference for the caller, NULL if it does not exist or an error occurs.
+open_file_t	*fd_cache_open(char *path)
+{
+	file_check_t	check;
+	open_file_t		*file;
+
+	if (fd_cache_begin(path, &check, &file))
+		return (file);
+	check_file(&check);
+	return (fd_cache_end(&check));
+}
+
+// Drop the open file at path, after the server changed the file.
+void	fd_cache_invalidate(char *path)
+{
+	open_file_t	*file = fd_cache_find(path);
+
+	if (file != NULL)
+		fd_cache_remove(file);
+}
+
+// Bits of a deflate stream, packed from the least significant bit of each byte.
+typedef struct bit_writer_t
+{
+	unsigned char	*buffer;
+	size_t			size;
+	size_t			capacity;
+	uint64_t		bits;
+	int				bit_count;
+	int				failed; // Set if the buffer could not be grown.
+}	bit_writer_t;
+
+void	put_bits(bit_writer_t *writer, uint32_t value, int count)
+{
+	if (writer->failed)
+		return ;
+	writer->bits |= (uint64_t)value << writer->bit_count;
+	writer->bit_count += count;
+	while (writer->bit_count >= 8)
+	{
+		if (writer->size == writer->capacity)
+		{
+			unsigned char	*buffer = (unsigned char *)realloc(writer->buffer, 2 * writer->capacity);
+			if (buffer == NULL)
+			{
+				writer->failed = 1;
+				return ;
+			}
+			writer->buffer = buffer;
+			writer->capacity *= 2;
+		}
+		writer->buffer[writer->size++] = writer->bits & 0xff;
+		writer->bits >>= 8;
+		writer->bit_count -= 8;
+	}
+}
+
+// A literal byte (dist 0) or a match of length bytes dist bytes back, before Huffman coding.
+typedef struct deflate_symbol_t
+{
+	uint16_t	length; // The byte of a literal.
+	uint16_t	dist;
+}	deflate_symbol_t;
+
+// Smallest length and distance of each deflate code, and the extra bits that follow the code.
+const uint16_t	g_length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const uint8_t	g_length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const uint16_t	g_dist_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+const uint8_t	g_dist_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+// Order the lengths of the code length code are sent in.
+const uint8_t	g_code_length_order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+// Returns the code of value among the count codes starting at base.
+int	find_deflate_code(const uint16_t *base, int count, int value)
+{
+	int	code = 0;
+
+	while (code + 1 < count && base[code + 1] <= value)
+		code++;
+	return (code);
+}
+
+// Compute the lengths of the Huffman codes of count symbols with the frequencies freq, at most max_bits long.
+// At least two symbols must be used, so that the code is complete.
+void	huffman_code_lengths(uint32_t *freq, int count, int max_bits, uint8_t *lengths)
+{
+	int			symbols[286];
+	uint32_t	weight[2 * 286];
+	int			parent[2 * 286];
+	int			depth[2 * 286];
+	int			length_count[2 * 286] = {0};
+	int			used = 0;
+
+	memset(lengths, 0, count);
+	// Sort the used symbols by frequency. There are a few hundred at most, and this may run in the I/O pool,
+	// so an insertion sort does without the global state qsort() would need for the frequencies.
+	for (int i = 0; i < count; i++)
+	{
+		if (freq[i] == 0)
+			continue ;
+		int	pos = used++;
+		while (pos > 0 && freq[symbols[pos - 1]] > freq[i])
+		{
+			symbols[pos] = symbols[pos - 1];
+			pos--;
+		}
+		symbols[pos] = i;
+	}
+	// Merge the two lightest nodes until one is left. Leaves come sorted, and the merged nodes are made
+	// in order of weight, so the two lightest are always at the front of one of the two lists.
+	for (int i = 0; i < used; i++)
+		weight[i] = freq[symbols[i]];
+	int	leaf = 0;
+	int	node = used;
+	for (int next = used; next < 2 * used - 1; next++)
+	{
+		weight[next] = 0;
+		for (int pick = 0; pick < 2; pick++)
+		{
+			int	child = leaf < used && (node == next || weight[leaf] <= weight[node]) ? leaf++ : node++;
+			parent[child] = next;
+			weight[next] += weight[child];
+		}
+	}
+	depth[2 * used - 2] = 0;
+	for (int i = 2 * used - 3; i >= 0; i--)
+		depth[i] = depth[parent[i]] + 1;
+	for (int i = 0; i < used; i++)
+		length_count[depth[i]]++;
+	// Move the codes longer than max_bits up to max_bits, then lengthen shorter ones until the code is complete.
+	for (int i = max_bits + 1; i < used; i++)
+	{
+		length_count[max_bits] += length_count[i];
+		length_count[i] = 0;
+	}
+	uint32_t	total = 0;
+	for (int i = 1; i <= max_bits; i++)
+		total += (uint32_t)length_count[i] << (max_bits - i);
+	while (total > (1u << max_bits))
+	{
+		length_count[max_bits]--;
+		for (int i = max_bits - 1; i > 0; i--)
+		{
+			if (length_count[i] > 0)
+			{
+				length_count[i]--;
+				length_count[i + 1] += 2;
+				break ;
+			}
+		}
+		total--;
+	}
+	// The most frequent symbols get the shortest codes.
+	int	next_symbol = 0;
+	for (int bits = max_bits; bits > 0; bits--)
+		for (int i = 0; i < length_count[bits]; i++)
+			lengths[symbols[next_symbol++]] = bits;
+}
+
+// Compute the canonical Huffman codes of count symbols from their lengths, bit-reversed as deflate sends them.
+void	huffman_codes(uint8_t *lengths, int count, uint16_t *codes)
+{
+	int			length_count[16] = {0};
+	uint16_t	next_code[16];
+	uint16_t	code = 0;
+
+	for (int i = 0; i < count; i++)
+		length_count[lengths[i]]++;
+	length_count[0] = 0;
+	for (int bits = 1; bits < 16; bits++)
+	{
+		code = (code + length_count[bits - 1]) << 1;
+		next_code[bits] = code;
+	}
+	for (int i = 0; i < count; i++)
+	{
+		if (lengths[i] == 0)
+			continue ;
+		uint16_t	value = next_code[lengths[i]]++;
+		codes[i] = 0;
+		for (int bit = 0; bit < lengths[i]; bit++)
+			codes[i] |= ((value >> bit) & 1) << (lengths[i] - 1 - bit);
+	}
+}
+
+// Use the first unused symbols until at least two are used, so that the Huffman code is complete.
+void	use_two_symbols(uint32_t *freq, int count)
+{
+	int	used = 0;
+
+	for (int i = 0; i < count; i++)
+		used += freq[i] > 0;
+	for (int i = 0; i < count && used < 2; i++)
+	{
+		if (freq[i] == 0)
+		{
+			freq[i] = 1;
+			used++;
+		}
+	}
+}
+
+// Write the count symbols as a deflate block with dynamic Huffman codes (RFC 1951 3.2.7).
+void	deflate_write_block(bit_writer_t *writer, deflate_symbol_t *symbols, size_t count, int final)
+{
+	uint32_t	litlen_freq[286] = {0};
+	uint32_t	dist_freq[30] = {0};
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (symbols[i].dist == 0)
+			litlen_freq[symbols[i].length]++;
+		else
+		{
+			litlen_freq[257 + find_deflate_code(g_length_base, 29, symbols[i].length)]++;
+			dist_freq[find_deflate_code(g_dist_base, 30, symbols[i].dist)]++;
+		}
+	}
+	litlen_freq[256]++;
+	use_two_symbols(litlen_freq, 286);
+	use_two_symbols(dist_freq, 30);
+	uint8_t		lengths[286 + 30];
+	uint16_t	litlen_codes[286];
+	uint16_t	dist_codes[30];
+	huffman_code_lengths(litlen_freq, 286, 15, lengths);
+	huffman_code_lengths(dist_freq, 30, 15, lengths + 286);
+	huffman_codes(lengths, 286, litlen_codes);
+	huffman_codes(lengths + 286, 30, dist_codes);
+	int	litlen_count = 286;
+	while (litlen_count > 257 && lengths[litlen_count - 1] == 0)
+		litlen_count--;
+	int	dist_count = 30;
+	while (dist_count > 1 && lengths[286 + dist_count - 1] == 0)
+		dist_count--;
+	memmove(lengths + litlen_count, lengths + 286, dist_count);
+
+	// The code lengths are sent run-length encoded, with a Huffman code of their own.
+	uint8_t		runs[286 + 30];
+	uint8_t		run_extra[286 + 30];
+	int			run_count = 0;
+	uint32_t	run_freq[19] = {0};
+	int			total = litlen_count + dist_count;
+	for (int i = 0; i < total;)
+	{
+		int	length = lengths[i];
+		int	repeat = 1;
+		while (i + repeat < total && lengths[i + repeat] == length)
+			repeat++;
+		i += repeat;
+		if (length != 0)
+		{
+			runs[run_count++] = length;
+			repeat--;
+		}
+		while (repeat >= 3)
+		{
+			int	chunk = length != 0 ? (repeat < 6 ? repeat : 6) : (repeat < 138 ? repeat : 138);
+			runs[run_count] = length != 0 ? 16 : chunk >= 11 ? 18 : 17;
+			run_extra[run_count] = chunk - (runs[run_count] == 18 ? 11 : 3);
+			run_count++;
+			repeat -= chunk;
+		}
+		while (repeat-- > 0)
+			runs[run_count++] = length;
+	}
+	for (int i = 0; i < run_count; i++)
+		run_freq[runs[i]]++;
+	use_two_symbols(run_freq, 19);
+	uint8_t		run_lengths[19];
+	uint16_t	run_codes[19];
+	huffman_code_lengths(run_freq, 19, 7, run_lengths);
+	huffman_codes(run_lengths, 19, run_codes);
+	int	run_length_count = 19;
+	while (run_length_count > 4 && run_lengths[g_code_length_order[run_length_count - 1]] == 0)
+		run_length_count--;
+
+	put_bits(writer, final, 1);
+	put_bits(writer, 2, 2);
+	put_bits(writer, litlen_count - 257, 5);
+	put_bits(writer, dist_count - 1, 5);
+	put_bits(writer, run_length_count - 4, 4);
+	for (int i = 0; i < run_length_count; i++)
+		put_bits(writer, run_lengths[g_code_length_order[i]], 3);
+	for (int i = 0; i < run_count; i++)
+	{
+		put_bits(writer, run_codes[runs[i]], run_lengths[runs[i]]);
+		if (runs[i] >= 16)
+			put_bits(writer, run_extra[i], runs[i] == 16 ? 2 : runs[i] == 17 ? 3 : 7);
+	}
+	for (size_t i = 0; i < count; i++)
+	{
+		if (symbols[i].dist == 0)
+		{
+			put_bits(writer, litlen_codes[symbols[i].length], lengths[symbols[i].length]);
+			continue ;
+		}
+		int	code = find_deflate_code(g_length_base, 29, symbols[i].length);
+		put_bits(writer, litlen_codes[257 + code], lengths[257 + code]);
+		put_bits(writer, symbols[i].length - g_length_base[code], g_length_extra[code]);
+		code = find_deflate_code(g_dist_base, 30, symbols[i].dist);
+		put_bits(writer, dist_codes[code], lengths[litlen_count + code]);
+		put_bits(writer, symbols[i].dist - g_dist_base[code], g_dist_extra[code]);
+	}
+	put_bits(writer, litlen_codes[256], lengths[256]);
+}
+
+// Returns the CRC-32 of size bytes of data, as gzip checks it.
+uint32_t	gzip_crc32(unsigned char *data, size_t size)
+{
+	uint32_t	table[256];
+	uint32_t	crc = 0xffffffff;
+
+	// Built on every call, which costs little next to compressing, so that threads share no state.
+	for (uint32_t i = 0; i < 256; i++)
+	{
+		uint32_t	value = i;
+		for (int bit = 0; bit < 8; bit++)
+			value = value & 1 ? 0xedb88320 ^ (value >> 1) : value >> 1;
+		table[i] = value;
+	}
+	for (size_t i = 0; i < size; i++)
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return (crc ^ 0xffffffff);
+}
+
+#define DEFLATE_HASH(data) ((((data)[0] << 10) ^ ((data)[1] << 5) ^ (data)[2]) & ((1 << DEFLATE_HASH_BITS) - 1))
+
+// Compress size bytes of data into a gzip file (RFC 1952), with greedy LZ77 matching over hash chains.
+// Meant for the text files served, compressed once and then cached.
+// Returns the compressed bytes allocated with malloc(), or NULL if not successful.
+char	*gzip_compress(char *data, size_t size, size_t *compressed_size)
+{
+	unsigned char		*input = (unsigned char *)data;
+	int32_t				*head = (int32_t *)malloc(sizeof(int32_t) << DEFLATE_HASH_BITS);
+	int32_t				*prev = (int32_t *)malloc(sizeof(int32_t) * DEFLATE_WINDOW_SIZE);
+	deflate_symbol_t	*symbols = (deflate_symbol_t *)malloc(sizeof(deflate_symbol_t) * DEFLATE_BLOCK_SYMBOLS);
+	bit_writer_t		writer = {0};
+	size_t				symbol_count = 0;
+
+	writer.capacity = size + size / 8 + 64;
+	writer.buffer = (unsigned char *)malloc(writer.capacity);
+	if (head == NULL || prev == NULL || symbols == NULL || writer.buffer == NULL)
+		writer.failed = 1;
+	else
+		memset(head, -1, sizeof(int32_t) << DEFLATE_HASH_BITS);
+	// Header without a name or a modification time, from a Unix system.
+	unsigned char	header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3};
+	for (int i = 0; i < 10 && !writer.failed; i++)
+		put_bits(&writer, header[i], 8);
+	for (size_t pos = 0; pos < size && !writer.failed;)
+	{
+		size_t	best_length = 0;
+		size_t	best_dist = 0;
+		size_t	max_length = size - pos < 258 ? size - pos : 258;
+		if (max_length >= 3)
+		{
+			int32_t	candidate = head[DEFLATE_HASH(input + pos)];
+			for (int chain = 0; candidate >= 0 && pos - candidate < DEFLATE_WINDOW_SIZE && chain < DEFLATE_MAX_CHAIN; chain++)
+			{
+				if (input[candidate + best_length] == input[pos + best_length])
+				{
+					size_t	length = 0;
+					while (length < max_length && input[candidate + length] == input[pos + length])
+						length++;
+					if (length > best_length)
+					{
+						best_length = length;
+						best_dist = pos - candidate;
+						if (length == max_length)
+							break ;
+					}
+				}
+				candidate = prev[candidate & (DEFLATE_WINDOW_SIZE - 1)];
+			}
+		}
+		if (best_length >= 3)
+			symbols[symbol_count] = (deflate_symbol_t){best_length, best_dist};
+		else
+		{
+			symbols[symbol_count] = (deflate_symbol_t){input[pos], 0};
+			best_length = 1;
+		}
+		for (size_t end = pos + best_length; pos < end; pos++)
+		{
+			if (pos + 3 > size)
+				continue ;
+			unsigned int	hash = DEFLATE_HASH(input + pos);
+			prev[pos & (DEFLATE_WINDOW_SIZE - 1)] = head[hash];
+			head[hash] = pos;
+		}
+		if (++symbol_count == DEFLATE_BLOCK_SYMBOLS)
+		{
+			deflate_write_block(&writer, symbols, symbol_count, 0);
+			symbol_count = 0;
+		}
+	}
+	if (!writer.failed)
+	{
+		deflate_write_block(&writer, symbols, symbol_count, 1);
+		put_bits(&writer, 0, (8 - writer.bit_count) & 7);
+		uint32_t	crc = gzip_crc32(input, size);
+		for (int i = 0; i < 4; i++)
+			put_bits(&writer, (crc >> (8 * i)) & 0xff, 8);
+		for (int i = 0; i < 4; i++)
+			put_bits(&writer, ((uint32_t)size >> (8 * i)) & 0xff, 8);
+	}
+	free (head);
+	free (prev);
+	free (symbols);
+	if (writer.failed)
+	{
+		ERROR_PRTF ("SERVER ERROR: Failed to compress %zu bytes\n", size);
+		free (writer.buffer);
+		return (NULL);
+	}
+	*compressed_size = writer.size;
+	return ((char *)writer.buffer);
+}
+
+// A cached 200 OK response of a static file: its header without the Connection fields, and the file bytes,
+// as they are or compressed by the server. The entry stays valid while the open file keeps the device, inode,
+// size and modification time it was read with.
+typedef struct cache_entry_t
+{
+	char					*path; // Canonical path of the file, the key of the entry with the coding.
+	content_coding_t		coding; // Coding the server applied to the file bytes.
+	char					*header; // Status line and header fields, without the terminating blank line.
+	size_t					header_size;
+	char					*body;
+	size_t					body_size;
+	off_t					file_size;
+	dev_t					dev;
+	ino_t					ino;
+	time_t					mtime;
+	int						refcount; // One for the cache while the entry is in it, one per queued response.
+	struct cache_entry_t	*hash_next;
+	struct cache_entry_t	*lru_prev; // Neighbours in the LRU list, most recently used first.
+	struct cache_entry_t	*lru_next;
+}	cache_entry_t;
+
+// Static content cache of a worker, bounded to g_config.cache_size bytes.
+typedef struct content_cache_t
+{
+	cache_entry_t	*buckets[CONTENT_CACHE_BUCKETS];
+	cache_entry_t	*lru_head;
+	cache_entry_t	*lru_tail;
+	size_t			entry_count;
+	size_t			bytes; // Bytes held by the entries in the cache, paths and headers included.
+	size_t			hits;
+	size_t			misses;
+	size_t			evictions;
+	size_t			invalidations; // Entries dropped because the file changed.
+}	content_cache_t;
+
+content_cache_t	g_content_cache;
+
+size_t	cache_entry_bytes(cache_entry_t *entry)
+{
+	return (sizeof(cache_entry_t) + strlen(entry->path) + 1 + entry->header_size + entry->body_size);
+}
+
+// Drop a reference to the entry, and free it with the last one.
+void	cache_entry_release(cache_entry_t *entry)
+{
+	if (entry == NULL || --entry->refcount > 0)
+		return ;
+	free (entry->path);
+	free (entry->header);
+	free (entry->body);
+	free (entry);
+}
+
+// Remove the entry from the cache. Responses still queued with it keep it alive until they are sent.
+void	content_cache_remove(cache_entry_t *entry)
+{
+	cache_entry_t	**link = &g_content_cache.buckets[hash_string(entry->path) % CONTENT_CACHE_BUCKETS];
+
+	while (*link != entry)
+		link = &(*link)->hash_next;
+	*link = entry->hash_next;
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		g_content_cache.lru_head = entry->lru_next;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		g_content_cache.lru_tail = entry->lru_prev;
+	g_content_cache.entry_count--;
+	g_content_cache.bytes -= cache_entry_bytes(entry);
+	cache_entry_release(entry);
+}
+
+void	content_cache_push_front(cache_entry_t *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = g_content_cache.lru_head;
+	if (g_content_cache.lru_head)
+		g_content_cache.lru_head->lru_prev = entry;
+	else
+		g_content_cache.lru_tail = entry;
+	g_content_cache.lru_head = entry;
+}
+
+// Find the cached response of the open file in coding, if it was read from the same version of the file.
+// Returns the entry if it is cached and up to date, NULL if not.
+cache_entry_t	*content_cache_lookup(open_file_t *file, content_coding_t coding)
+{
+	cache_entry_t	*entry = g_content_cache.buckets[hash_string(file->real_path) % CONTENT_CACHE_BUCKETS];
+
+	while (entry != NULL && (entry->coding != coding || strcmp(entry->path, file->real_path) != 0))
+		entry = entry->hash_next;
+	if (entry == NULL)
+	{
+		g_content_cache.misses++;
+		return (NULL);
+	}
+	if (file->dev != entry->dev || file->ino != entry->ino || file->size != entry->file_size
+		|| file->mtime != entry->mtime)
+	{
+		content_cache_remove(entry);
+		g_content_cache.invalidations++;
+		g_content_cache.misses++;
+		return (NULL);
+	}
+	// Move the entry to the front of the LRU list.
+	if (entry != g_content_cache.lru_head)
+	{
+		entry->lru_prev->lru_next = entry->lru_next;
+		if (entry->lru_next)
+			entry->lru_next->lru_prev = entry->lru_prev;
+		else
+			g_content_cache.lru_tail = entry->lru_prev;
+		content_cache_push_front(entry);
+	}
+	g_content_cache.hits++;
+	return (entry);
+}
+
+// Read the whole open file into buffer (file->size bytes).
+// Returns 0 if successful, -1 if not.
+int	read_open_file(open_file_t *file, char *buffer)
+{
+	size_t	size = 0;
+
+	while (size < (size_t)file->size)
+	{
+		ssize_t	bytes_read = pread(file->fd, buffer + size, file->size - size, size);
+		if (bytes_read == -1 && errno == EINTR)
+			continue;
+		if (bytes_read <= 0)
+		{
+			ERROR_PRTF ("SERVER ERROR: Failed to read %s\n", file->real_path);
+			return (-1);
+		}
+		size += bytes_read;
+	}
+	return (0);
+}
+
+// Create an entry of the body (body_size bytes) made from the open file in coding, with the header of response.
+// Takes ownership of body, but not of file or response. The entry is not in the cache yet.
+// Returns the entry with one reference for the caller, NULL if not successful.
+cache_entry_t	*cache_entry_create(open_file_t *file, content_coding_t coding, http_t *response,
+	char *body, size_t body_size)
+{
+	cache_entry_t	*entry = (cache_entry_t *)calloc(1, sizeof(cache_entry_t));
+	if (entry == NULL)
+	{
+		free (body);
+		return (NULL);
+	}
+	entry->refcount = 1;
+	entry->path = strdup(file->real_path);
+	entry->coding = coding;
+	entry->body = body;
+	entry->body_size = body_size;
+	ssize_t	header_size = write_http_header_to_buffer (response, (void **)&entry->header);
+	if (entry->path == NULL || entry->body == NULL || header_size == -1)
+	{
+		ERROR_PRTF ("SERVER ERROR: Failed to allocate cache entry\n");
+		cache_entry_release(entry);
+		return (NULL);
+	}
+	// The blank line comes after the Connection fields, which depend on the request.
+	entry->header_size = header_size - 2;
+	entry->file_size = file->size;
+	entry->dev = file->dev;
+	entry->ino = file->ino;
+	entry->mtime = file->mtime;
+	return (entry);
+}
+
+// Add a new entry to the cache, evicting the least recently used entries to stay within g_config.cache_size.
+// The cache takes the reference of the caller if the entry fits.
+// Returns 1 if the entry was added, 0 if it does not fit.
+int	content_cache_add(cache_entry_t *entry)
+{
+	size_t	entry_bytes = cache_entry_bytes(entry);
+
+	if (entry->body_size > g_config.cache_max_entry || entry_bytes > g_config.cache_size)
+		return (0);
+	while (g_content_cache.lru_tail != NULL && g_content_cache.bytes + entry_bytes > g_config.cache_size)
+	{
+		content_cache_remove(g_content_cache.lru_tail);
+		g_content_cache.evictions++;
+	}
+	unsigned int	bucket = hash_string(entry->path) % CONTENT_CACHE_BUCKETS;
+	entry->hash_next = g_content_cache.buckets[bucket];
+	g_content_cache.buckets[bucket] = entry;
+	content_cache_push_front(entry);
+	g_content_cache.entry_count++;
+	g_content_cache.bytes += entry_bytes;
+	return (1);
+}
+
+// Returns 1 if the body of the open file, as it is, fits in the content cache, 0 if not.
+int	is_cacheable(open_file_t *file)
+{
+	return ((size_t)file->size <= g_config.cache_max_entry && (size_t)file->size < g_config.cache_size);
+}
+
+// Returns 1 if the server compresses the open file itself when the client accepts gzip, 0 if not.
+// Only text files that fit in the content cache are, so that each one is compressed once.
+int	is_compressed_on_the_fly(open_file_t *file)
+{
+	return ((size_t)file->size >= g_config.compress_min_size && is_cacheable(file)
+		&& is_compressible_type(get_file_extension(file->path)));
+}
+
+// Read the whole open file for a cache entry, and compress it with gzip if compress is set.
+// Returns the bytes allocated with malloc(), with their number in *body_size, NULL if not successful.
+char	*load_open_file(open_file_t *file, int compress, size_t *body_size)
+{
+	char	*data = (char *)malloc(file->size > 0 ? file->size : 1);
+
+	if (data == NULL || read_open_file(file, data) == -1)
+	{
+		free (data);
+		return (NULL);
+	}
+	*body_size = file->size;
+	if (!compress)
+		return (data);
+	char	*compressed = gzip_compress(data, file->size, body_size);
+	free (data);
+	return (compressed);
+}
+
+// Set by SIGUSR1, to print the statistics of the worker from its event loop.
+volatile sig_atomic_t	g_print_stats = 0;
+
+void	request_stats(int signum)
+{
+	(void)signum;
+	g_print_stats = 1;
+}
+
+// A block of memory of an arena. Blocks are chained from the current one to the first one.
+typedef struct arena_block_t
+{
+	struct arena_block_t	*prev;
+	size_t					size;
+	size_t					used;
+	char					data[];
+}	arena_block_t;
+
+// Bump allocator backing the http structs of a request and all their strings.
+// Nothing is freed on its own: arena_reset() drops everything at once and keeps the first block for the next request.
+typedef struct arena_t
+{
+	arena_block_t	*current;
+}	arena_t;
+
+// Returns size bytes aligned to 16 bytes from the arena, or NULL if not successful.
+void	*arena_alloc(arena_t *arena, size_t size)
+{
+	arena_block_t	*block = arena->current;
+	size_t			pad = block ? -(uintptr_t)(block->data + block->used) & 15 : 0;
+
+	if (block == NULL || block->used + pad + size > block->size)
+	{
+		size_t	block_size = size + 15 > ARENA_BLOCK_SIZE ? size + 15 : ARENA_BLOCK_SIZE;
+		block = (arena_block_t *)malloc(sizeof(arena_block_t) + block_size);
+		if (block == NULL)
+		{
+			ERROR_PRTF ("SERVER ERROR: Failed to allocate arena block\n");
+			return (NULL);
+		}
+		block->prev = arena->current;
+		block->size = block_size;
+		block->used = 0;
+		arena->current = block;
+		pad = -(uintptr_t)block->data & 15;
+	}
+	void	*ptr = block->data + block->used + pad;
+	block->used += pad + size;
+	return (ptr);
+}
+
+char	*arena_strdup(arena_t *arena, char *str)
+{
+	size_t	len = strlen(str);
+	char	*copy = (char *)arena_alloc(arena, len + 1);
+
+	if (copy != NULL)
+		memcpy(copy, str, len + 1);
+	return (copy);
+}
+
+// Free everything allocated from the arena. Only the blocks added for a large request are freed,
+// so this is O(1) for most requests.
+void	arena_reset(arena_t *arena)
+{
+	while (arena->current != NULL && arena->current->prev != NULL)
+	{
+		arena_block_t	*block = arena->current;
+		arena->current = block->prev;
+		free (block);
+	}
+	if (arena->current != NULL)
+		arena->current->used = 0;
+}
+
+void	arena_free(arena_t *arena)
+{
+	arena_reset(arena);
+	free (arena->current);
+	arena->current = NULL;
+}
+
+// Same as init_http_with_arg(), with the struct and its strings allocated from the arena.
+// The http struct must not be passed to free_http(), it is freed with the arena.
+http_t	*arena_init_http_with_arg(arena_t *arena, char *method, char *path, char *version, char *status)
+{
+	if (version == NULL || status == NULL)
+	{
+		ERROR_PRTF ("SERVER ERROR: arena_init_http_with_arg(): NULL parameter\n");
+		return (NULL);
+	}
+	http_t	*http = (http_t *)arena_alloc(arena, sizeof(http_t));
+	if (http == NULL)
+		return (NULL);
+	memset(http, 0, sizeof(http_t));
+	http->max_field_count = DEFAULT_MAX_FIELD_NUM;
+	http->fields = (http_field_t *)arena_alloc(arena, http->max_field_count * sizeof(http_field_t));
+	http->method = method ? arena_strdup(arena, method) : NULL;
+	http->path = path ? arena_strdup(arena, path) : NULL;
+	http->version = arena_strdup(arena, version);
+	http->status = arena_strdup(arena, status);
+	if (http->fields == NULL || (method && http->method == NULL) || (path && http->path == NULL)
+		|| http->version == NULL || http->status == NULL)
+		return (NULL);
+	return (http);
+}
+
+// Same as find_http_field_val(), with case-insensitive names. Responses only carry the few fields
+// the server adds, so they are not indexed like requests.
+char	*find_response_field(http_t *http, char *field)
+{
+	for (int i = 0; i < http->field_count; i++)
+		if (strcasecmp(http->fields[i].field, field) == 0)
+			return (http->fields[i].val);
+	return (NULL);
+}
+
+// Same as add_field_to_http(), with the strings allocated from the arena.
+// Returns 0 if successful, -1 if not.
+int	arena_add_field_to_http(arena_t *arena, http_t *http, char *field, char *val)
+{
+	if (http == NULL || field == NULL || val == NULL)
+	{
+		ERROR_PRTF ("SERVER ERROR: arena_add_field_to_http(): NULL parameter\n");
+		return (-1);
+	}
+	if (find_response_field (http, field) != NULL)
+	{
+		ERROR_PRTF ("SERVER ERROR: arena_add_field_to_http(): field already exists\n");
+		return (-1);
+	}
+	if (http->field_count == http->max_field_count)
+	{
+		http_field_t	*fields = (http_field_t *)arena_alloc(arena, 2 * http->max_field_count * sizeof(http_field_t));
+		if (fields == NULL)
+			return (-1);
+		memcpy(fields, http->fields, http->field_count * sizeof(http_field_t));
+		http->fields = fields;
+		http->max_field_count *= 2;
+	}
+	http_field_t	*new_field = &http->fields[http->field_count];
+	new_field->field = arena_strdup(arena, field);
+	new_field->val = arena_strdup(arena, val);
+	if (new_field->field == NULL || new_field->val == NULL)
+		return (-1);
+	http->field_count++;
+	return (0);
+}
+
+// Same as add_body_to_http(), with the copy of the body allocated from the arena.
+// Returns 0 if successful, -1 if not.
+int	arena_add_body_to_http(arena_t *arena, http_t *http, size_t body_size, void *body_data)
+{
+	if (http == NULL)
+	{
+		ERROR_PRTF ("SERVER ERROR: arena_add_body_to_http(): NULL parameter\n");
+		return (-1);
+	}
+	if (body_size == 0 || body_data == NULL)
+		return (0);
+	if (http->body_data != NULL || http->body_size != 0)
+	{
+		ERROR_PRTF ("SERVER ERROR: arena_add_body_to_http(): body_data already exists\n");
+		return (-1);
+	}
+	if (find_response_field (http, "Content-Length") == NULL)
+	{
+		char	content_length[32];
+		sprintf(content_length, "%zu", body_size);
+		if (arena_add_field_to_http (arena, http, "Content-Length", content_length) == -1)
+			return (-1);
+	}
+	http->body_data = arena_alloc(arena, body_size);
+	if (http->body_data == NULL)
+		return (-1);
+	memcpy(http->body_data, body_data, body_size);
+	http->body_size = body_size;
+	return (0);
+}
+
+// State of the multipart/form-data parser of an upload.
+typedef enum multipart_state_t
+{
+	MULTIPART_BODY, // In the preamble or the body of a part, up to the next delimiter.
+	MULTIPART_DELIMITER_END, // After a delimiter: "--" ends the multipart body, CRLF starts a part.
+	MULTIPART_PART_HEADER,
+	MULTIPART_DONE // After the last delimiter. The epilogue is ignored.
+}	multipart_state_t;
+
+// Upload of an image to the album, parsed from the multipart body as it is received.
+// The body goes through a window of bounded size, and the image is written to a temporary file
+// in the album directory as it arrives, then renamed to its name once complete.
+typedef struct upload_t
+{
+	multipart_state_t	state;
+	char				delimiter[4 + MAX_BOUNDARY_SIZE]; // "\r\n--" followed by the boundary.
+	size_t				delimiter_len;
+	size_t				skip[256]; // Boyer-Moore-Horspool shift of each byte value, for delimiter.
+	int					file_fd; // Temporary file of the image in the current part, -1 if the part is skipped.
+	char				temp_path[MAX_PATH_SIZE];
+	char				filename[MAX_FILENAME_SIZE]; // Name of the image in the current part.
+	int					saved; // An image was saved.
+	int					image_changed; // The image of filename was saved since upload_invalidate_cache().
+	int					album_changed; // album.html was changed since upload_invalidate_cache().
+	off_t				file_size; // Bytes of the image written so far.
+	off_t				splice_start; // Offset of the image where the bytes not parsed yet start, -1 if none.
+	int					pipe_fds[2]; // Pipe the body is spliced through from the socket to the image, -1 if none.
+	size_t				window_len;
+	char				window[UPLOAD_WINDOW_SIZE];
+}	upload_t;
+
+// Start the upload sent in the body of request, whose Content-Type must be multipart/form-data with a boundary.
+// Returns NULL if not successful.
+upload_t	*upload_start(http_request_t *request)
+{
+	char	*content_type = request_header(request, HDR_CONTENT_TYPE);
+	char	*boundary = content_type ? strcasestr(content_type, "boundary=") : NULL;
+	size_t	boundary_len = 0;
+
+	if (boundary != NULL)
+	{
+		boundary += strlen("boundary=");
+		if (*boundary == '"')
+			boundary_len = strcspn(++boundary, "\"");
+		else
+			boundary_len = strcspn(boundary, "; \t");
+	}
+	if (boundary_len == 0 || boundary_len > MAX_BOUNDARY_SIZE)
+	{
+		ERROR_PRTF ("SERVER ERROR: Failed to receive HTTP post request.\n");
+		return (NULL);
+	}
+	upload_t	*upload = (upload_t *)malloc(sizeof(upload_t));
+	if (upload == NULL)
+	{
+		ERROR_PRTF ("SERVER ERROR: Failed to allocate upload\n");
+		return (NULL);
+	}
+	upload->state = MULTIPART_BODY;
+	memcpy(upload->delimiter, "\r\n--", 4);
+	memcpy(upload->delimiter + 4, boundary, boundary_len);
+	upload->delimiter_len = 4 + boundary_len;
+	for (int i = 0; i < 256; i++)
+		upload->skip[i] = upload->delimiter_len;
+	for (size_t i = 0; i + 1 < upload->delimiter_len; i++)
+		upload->skip[(unsigned char)upload->delimiter[i]] = upload->delimiter_len - 1 - i;
+	upload->file_fd = -1;
+	upload->saved = 0;
+	upload->image_changed = 0;
+	upload->album_changed = 0;
+	upload->splice_start = -1;
+	upload->pipe_fds[0] = -1;
+	upload->pipe_fds[1] = -1;
+	// The first delimiter may open the body, without the CRLF that ends the preamble.
+	memcpy(upload->window, "\r\n", 2);
+	upload->window_len = 2;
+	return (upload);
+}
+
+// Free the upload, removing the image it was writing if it is not complete.
+void	upload_free(upload_t *upload)
+{
+	if (upload == NULL)
+		return ;
+	if (upload->file_fd != -1)
+	{
+		close(upload->file_fd);
+		unlink(upload->temp_path);
+	}
+	if (upload->pipe_fds[0] != -1)
+	{
+		close(upload->pipe_fds[0]);
+		close(upload->pipe_fds[1]);
+	}
+	free(upload);
+}
+
+// Find the delimiter of the upload in buf, with the Boyer-Moore-Horspool algorithm.
+// Returns the offset of its first occurrence, -1 if there is none.
+ssize_t	upload_find_delimiter(upload_t *upload, char *buf, size_t len)
+{
+	size_t	last = upload->delimiter_len - 1;
+
+	for (size_t pos = 0; pos + last < len; pos += upload->skip[(unsigned char)buf[pos + last]])
+	{
+		if (buf[pos + last] == upload->delimiter[last] && memcmp(buf + pos, upload->delimiter, last) == 0)
+			return (pos);
+	}
+	return (-1);
+}
+
+// Start a part with the given header. The first part that carries a file is saved as an image of the album,
+// the others are skipped.
+// Returns 0 if successful, -1 if not.
+int	upload_start_part(upload_t *upload, char *header)
+{
+	printf ("\tHTTP ");
+	GREEN_PRTF ("POST BODY:\n");
+	printf ("%s\n", header);
+
+	// Get the filename of the file.
+	char	*filename = strstr(header, "filename=\"");
+	if (filename == NULL || upload->saved)
+		return (0);
+	filename += strlen("filename=\"");
+	size_t	filename_len = strcspn(filename, "\"");
+	if (filename_len >= MAX_FILENAME_SIZE)
+		filename_len = 0;
+	memcpy(upload->filename, filename, filename_len);
+	upload->filename[filename_len] = '\0';
+	// Check if the file is an image file. Its name goes into the album path and html, so it must stay inside both.
+	char	*file_extension = get_file_extension(upload->filename);
+	if (file_extension == NULL || strcasecmp(file_extension, "jpg") != 0
+		|| upload->filename[0] == '.' || strpbrk(upload->filename, "/\\<>&") != NULL)
+	{
+		ERROR_PRTF ("SERVER ERROR: Invalid file type\n");
+		return (-1);
+	}
+	snprintf(upload->temp_path, MAX_PATH_SIZE, "%s%s/.upload-XXXXXX", SERVER_ROOT, ALBUM_PATH);
+	upload->file_fd = mkstemp(upload->temp_path);
+	upload->file_size = 0;
+	if (upload->file_fd == -1 || fchmod(upload->file_fd, 0644) == -1)
+	{
+		ERROR_PRTF ("SERVER ERROR: Failed to create %s\n", upload->temp_path);
+		return (-1);
+	}
+	return (0);
+}
+
+// Write len bytes of the body of the current part to its image, if it is saved.
+// Returns 0 if successful, -1 if not.
+int	upload_write(upload_t *upload, char *data, size_t len)
+{
+	while (upload->file_fd != -1 && len > 0)
+	{
+		ssize_t	bytes_written = write(upload->file_fd, data, len);
+		if (bytes_written == -1 && errno == EINTR)
+			continue;
+		if (bytes_written <= 0)
+		{
+			ERROR_PRTF ("SERVER ERROR: Failed to write %s\n", upload->temp_path);
+			return (-1);
+		}
+		data += bytes_written;
+		len -= bytes_written;
+		upload->file_size += bytes_written;
+	}
+	return (0);
+}
+
+// End the current part. If it was saved, its image is moved into the album, and added to album.html if it is new.
+// Returns 0 if successful, -1 if not.
+int	upload_finish_part(upload_t *upload)
+{
+	if (upload->file_fd == -1)
+		return (0);
+	int	close_ret = close(upload->file_fd);
+	upload->file_fd = -1;
+	char		image_path[MAX_PATH_SIZE];
+	struct stat	image_stat;
+	snprintf(image_path, MAX_PATH_SIZE, "%s%s/%s", SERVER_ROOT, ALBUM_PATH, upload->filename);
+	int	is_new = stat(image_path, &image_stat) == -1;
+	if (close_ret == -1 || rename(upload->temp_path, image_path) == -1)
+	{
+		ERROR_PRTF ("SERVER ERROR: Failed to save %s\n", image_path);
+		unlink(upload->temp_path);
+		return (-1);
+	}
+	upload->saved = 1;
+	upload->image_changed = 1;
+	if (!is_new)
+		return (0);
+	// Append the appropriate html for the new image to album.html.
+	char	html_append[sizeof(ALBUM_HTML_TEMPLATE) + 2 * MAX_FILENAME_SIZE];
+	sprintf (html_append, ALBUM_HTML_TEMPLATE, upload->filename, upload->filename);
+	append_file (ALBUM_HTML_PATH , html_append, strlen (html_append));
+	upload->album_changed = 1;
+	return (0);
+}
+
+// Drop the files the upload changed from the open file cache.
+// upload_finish_part() may run in the I/O pool, and the cache belongs to the event loop thread, so it is done here.
+void	upload_invalidate_cache(upload_t *upload)
+{
+	char	image_path[MAX_PATH_SIZE];
+
+	if (upload->image_changed)
+	{
+		snprintf(image_path, MAX_PATH_SIZE, "%s%s/%s", SERVER_ROOT, ALBUM_PATH, upload->filename);
+		fd_cache_invalidate (image_path);
+	}
+	if (upload->album_changed)
+		fd_cache_invalidate (ALBUM_HTML_PATH);
+	upload->image_changed = 0;
+	upload->album_changed = 0;
+}
+
+// Parse as much of the window as possible, and keep the bytes that can not be parsed yet at its start.
+// Returns 0 if successful, -1 if the body is malformed or the image can not be saved.
+int	upload_process(upload_t *upload)
+{
+	char	*buf = upload->window;
+	size_t	len = upload->window_len;
+	size_t	pos = 0;
+
+	while (pos < len && upload->state != MULTIPART_DONE)
+	{
+		if (upload->state == MULTIPART_BODY)
+		{
+			// Without a delimiter, only the bytes that can not start one are known to be part of the body.
+			ssize_t	found = upload_find_delimiter(upload, buf + pos, len - pos);
+			size_t	body_len = found != -1 ? (size_t)found
+				: (len - pos >= upload->delimiter_len ? len - pos - (upload->delimiter_len - 1) : 0);
+			if (upload_write(upload, buf + pos, body_len) == -1)
+				return (-1);
+			pos += body_len;
+			if (found == -1)
+				break ;
+			pos += upload->delimiter_len;
+			if (upload_finish_part(upload) == -1)
+				return (-1);
+			upload->state = MULTIPART_DELIMITER_END;
+		}
+		else if (upload->state == MULTIPART_DELIMITER_END)
+		{
+			if (len - pos < 2)
+				break ;
+			if (memcmp(buf + pos, "--", 2) == 0)
+				upload->state = MULTIPART_DONE;
+			else if (memcmp(buf + pos, "\r\n", 2) == 0)
+				upload->state = MULTIPART_PART_HEADER;
+			else
+			{
+				ERROR_PRTF ("SERVER ERROR: Failed to parse HTTP post body.\n");
+				return (-1);
+			}
+		}
+		else
+		{
+			// The header starts after the CRLF of the delimiter, and is empty if a blank line follows it.
+			char	*header_end = memmem(buf + pos, len - pos, "\r\n\r\n", 4);
+			size_t	header_len = header_end != NULL ? header_end - (buf + pos) : len - pos;
+			header_len = header_len > 2 ? header_len - 2 : 0;
+			if (header_len > MAX_PART_HEADER_SIZE)
+			{
+				ERROR_PRTF ("SERVER ERROR: Failed to parse HTTP post body.\n");
+				return (-1);
+			}
+			if (header_end == NULL)
+				break ;
+			char	header[MAX_PART_HEADER_SIZE + 1];
+			memcpy(header, buf + pos + 2, header_len);
+			header[header_len] = '\0';
+			if (upload_start_part(upload, header) == -1)
+				return (-1);
+			pos = header_end + 4 - buf;
+			upload->state = MULTIPART_BODY;
+		}
+	}
+	if (upload->state == MULTIPART_DONE)
+		pos = len;
+	memmove(buf, buf + pos, len - pos);
+	upload->window_len = len - pos;
+	return (0);
+}
+
+// Returns 1 if the next bytes of the body can be spliced to the image, 0 if they must be parsed.
+int	upload_can_splice(upload_t *upload)
+{
+#ifdef __linux__
+	return (upload->state == MULTIPART_BODY && upload->file_fd != -1);
+#else
+	return (0);
+#endif
+}
+
+// Move up to count bytes of the body from sock to the image with splice(), through a pipe,
+// without copying them to user space. They are not parsed: the caller stops UPLOAD_SPLICE_TAIL bytes before
+// the end of the body given by Content-Length, so the delimiter that ends the image is in the bytes parsed after.
+// Returns the number of bytes moved, 0 if the client stopped sending, or -1 with errno set.
+ssize_t	upload_splice(upload_t *upload, int sock, size_t count)
+{
+#ifdef __linux__
+	if (upload->pipe_fds[0] == -1)
+	{
+		if (pipe2(upload->pipe_fds, O_NONBLOCK) == -1)
+			return (-1);
+		fcntl(upload->pipe_fds[1], F_SETPIPE_SZ, UPLOAD_PIPE_SIZE);
+	}
+	if (upload->splice_start == -1)
+	{
+		// The bytes kept in the window are part of the image too, since its delimiter is in the tail.
+		upload->splice_start = upload->file_size;
+		if (upload_write(upload, upload->window, upload->window_len) == -1)
+		{
+			errno = EIO;
+			return (-1);
+		}
+		upload->window_len = 0;
+	}
+	size_t	moved = 0;
+	while (moved < count)
+	{
+		ssize_t	in_pipe = splice(sock, NULL, upload->pipe_fds[1], NULL, count - moved, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (in_pipe <= 0)
+		{
+			if (moved > 0 && (in_pipe == 0 || errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+				return (moved);
+			return (in_pipe);
+		}
+		// The pipe is emptied before the next splice, so the bytes never pile up in it.
+		while (in_pipe > 0)
+		{
+			ssize_t	out_pipe = splice(upload->pipe_fds[0], NULL, upload->file_fd, NULL, in_pipe, SPLICE_F_MOVE);
+			if (out_pipe == -1 && errno == EINTR)
+				continue;
+			if (out_pipe <= 0)
+			{
+				ERROR_PRTF ("SERVER ERROR: Failed to write %s\n", upload->temp_path);
+				errno = EIO;
+				return (-1);
+			}
+			in_pipe -= out_pipe;
+			moved += out_pipe;
+			upload->file_size += out_pipe;
+		}
+	}
+	return (moved);
+#else
+	errno = ENOSYS;
+	return (-1);
+#endif
+}
+
+// Take the last bytes spliced to the image back into the window, since the delimiter that ends the image
+// may start there and end in the bytes parsed next. Nothing else of what was spliced is read back.
+// Returns 0 if successful, -1 if not.
+int	upload_splice_end(upload_t *upload)
+{
+	size_t	len = upload->file_size - upload->splice_start;
+	size_t	keep = len < upload->delimiter_len - 1 ? len : upload->delimiter_len - 1;
+
+	upload->file_size -= keep;
+	upload->splice_start = -1;
+	if (pread(upload->file_fd, upload->window, keep, upload->file_size) != (ssize_t)keep
+		|| ftruncate(upload->file_fd, upload->file_size) == -1 || lseek(upload->file_fd, 0, SEEK_END) == -1)
+	{
+		ERROR_PRTF ("SERVER ERROR: Failed to write %s\n", upload->temp_path);
+		return (-1);
+	}
+	upload->window_len = keep;
+	return (0);
+}
+
+// Feed the next len bytes of the request body to the upload.
+// Returns 0 if successful, -1 if the upload failed.
+int	upload_feed(upload_t *upload, char *data, size_t len)
+{
+	if (upload->splice_start != -1 && upload_splice_end(upload) == -1)
+		return (-1);
+	while (len > 0)
+	{
+		size_t	copy_len = UPLOAD_WINDOW_SIZE - upload->window_len;
+		if (copy_len > len)
+			copy_len = len;
+		memcpy(upload->window + upload->window_len, data, copy_len);
+		upload->window_len += copy_len;
+		data += copy_len;
+		len -= copy_len;
+		if (upload_process(upload) == -1)
+			return (-1);
+	}
+	return (0);
+}
+
+// Disk operations done by the I/O pool, so that the event loop never waits for the disk.
+typedef enum io_type_t
+{
+	IO_OPEN, // Open a file, or check that an open one did not change, for fd_cache_open().
+	IO_READ, // Read a whole file for the content cache, and compress it if asked.
+	IO_UPLOAD, // Feed body bytes to an upload, which writes its image and album.html.
+	IO_SPLICE, // Splice body bytes of an upload from the socket to its image.
+	IO_TYPE_COUNT
+}	io_type_t;
+
+char	*g_io_type_names[IO_TYPE_COUNT] = {"open", "read", "upload", "splice"};
+
+// A disk operation for a connection, run by a thread of the I/O pool.
+// The connection waits for it, and does not touch what the job uses until it is back.
+typedef struct io_job_t
+{
+	io_type_t		type;
+	struct conn_t	*conn; // Connection waiting for the job.
+	size_t			submit_usec;
+	size_t			start_usec;
+	size_t			end_usec;
+	file_check_t	check; // IO_OPEN
+	open_file_t		*file; // IO_OPEN: file it opened, IO_READ: file to read. The job holds a reference.
+	int				compress; // IO_READ
+	char			*body; // IO_READ: bytes read, NULL if they could not be.
+	size_t			body_size;
+	upload_t		*upload; // IO_UPLOAD, IO_SPLICE
+	char			*data; // IO_UPLOAD: len bytes of body.
+	size_t			len; // IO_SPLICE: maximum number of bytes to splice.
+	int				sock; // IO_SPLICE
+	ssize_t			ret; // IO_UPLOAD, IO_SPLICE: what the function returned, with errno in error.
+	int				error;
+	struct io_job_t	*next;
+}	io_job_t;
+
+// Latency of the jobs of a type, to tell when the disk is the bottleneck.
+typedef struct io_stats_t
+{
+	size_t	count;
+	size_t	inline_count; // Done by the event loop because the pool does not run or its queue was full.
+	size_t	wait_usec; // Total time spent in the queue.
+	size_t	run_usec; // Total time spent doing the operation.
+	size_t	max_run_usec;
+}	io_stats_t;
+
+io_stats_t	g_io_stats[IO_TYPE_COUNT];
+
+#ifdef __linux__
+// Threads of a worker that run the disk operations. Jobs go in a bounded queue, and come back through done,
+// with event_fd signaled for the event loop.
+typedef struct io_pool_t
+{
+	int				thread_count;
+	pthread_mutex_t	lock;
+	pthread_cond_t	has_jobs;
+	io_job_t		*queue_head;
+	io_job_t		*queue_tail;
+	size_t			queued;
+	io_job_t		*done;
+	int				event_fd;
+}	io_pool_t;
+
+io_pool_t	g_io_pool = {0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0, NULL, -1};
+#endif
+
+void	io_job_free(io_job_t *job)
+{
+	while (job != NULL)
+	{
+		io_job_t	*next = job->next;
+		open_file_release(job->file);
+		free (job->body);
+		free (job);
+		job = next;
+	}
+}
+
+// Do the operation of the job, in a thread of the I/O pool or in the event loop.
+void	io_job_run(io_job_t *job)
+{
+	job->start_usec = get_time_usec();
+	if (job->type == IO_OPEN)
+		check_file(&job->check);
+	else if (job->type == IO_READ)
+		job->body = load_open_file(job->file, job->compress, &job->body_size);
+	else if (job->type == IO_UPLOAD)
+		job->ret = upload_feed(job->upload, job->data, job->len);
+	else
+	{
+		job->ret = upload_splice(job->upload, job->sock, job->len);
+		job->error = errno;
+	}
+	job->end_usec = get_time_usec();
+}
+
+void	io_stats_add(io_job_t *job, int is_inline)
+{
+	io_stats_t	*stats = &g_io_stats[job->type];
+	size_t		run_usec = job->end_usec - job->start_usec;
+
+	stats->count++;
+	stats->inline_count += is_inline;
+	stats->wait_usec += job->start_usec - job->submit_usec;
+	stats->run_usec += run_usec;
+	if (run_usec > stats->max_run_usec)
+		stats->max_run_usec = run_usec;
+}
+
+#ifdef __linux__
+void	*io_thread(void *arg)
+{
+	(void)arg;
+	while (1)
+	{
+		pthread_mutex_lock(&g_io_pool.lock);
+		while (g_io_pool.queue_head == NULL)
+			pthread_cond_wait(&g_io_pool.has_jobs, &g_io_pool.lock);
+		io_job_t	*job = g_io_pool.queue_head;
+		g_io_pool.queue_head = job->next;
+		if (g_io_pool.queue_head == NULL)
+			g_io_pool.queue_tail = NULL;
+		g_io_pool.queued--;
+		pthread_mutex_unlock(&g_io_pool.lock);
+
+		io_job_run(job);
+
+		pthread_mutex_lock(&g_io_pool.lock);
+		job->next = g_io_pool.done;
+		g_io_pool.done = job;
+		pthread_mutex_unlock(&g_io_pool.lock);
+		uint64_t	one = 1;
+		while (write(g_io_pool.event_fd, &one, sizeof(one)) == -1 && errno == EINTR)
+			;
+	}
+	return (NULL);
+}
+#endif
+
+// Start the g_config.io_threads threads of the I/O pool of this worker.
+// Returns the eventfd signaled when jobs are done, -1 if the pool is not used.
+int	io_pool_start()
+{
+#ifdef __linux__
+	if (g_config.io_threads == 0)
+		return (-1);
+	g_io_pool.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (g_io_pool.event_fd == -1)
+	{
+		ERROR_PRTF ("SERVER ERROR: eventfd() error\n");
+		return (-1);
+	}
+	// The signals are for the event loop, so the threads block them.
+	sigset_t	all_signals;
+	sigset_t	old_signals;
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+	for (int i = 0; i < g_config.io_threads; i++)
+	{
+		pthread_t	thread;
+		if (pthread_create(&thread, NULL, io_thread, NULL) != 0)
+		{
+			ERROR_PRTF ("SERVER ERROR: pthread_create() error\n");
+			break ;
+		}
+		pthread_detach(thread);
+		g_io_pool.thread_count++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+	if (g_io_pool.thread_count == 0)
+	{
+		close(g_io_pool.event_fd);
+		g_io_pool.event_fd = -1;
+		return (-1);
+	}
+	return (g_io_pool.event_fd);
+#else
+	return (-1);
+#endif
+}
+
+// Create a job of type for the connection.
+// Returns NULL if not successful.
+io_job_t	*io_job_create(struct conn_t *conn, io_type_t type)
+{
+	io_job_t	*job = (io_job_t *)calloc(1, sizeof(io_job_t));
+	if (job == NULL)
+	{
+		ERROR_PRTF ("SERVER ERROR: Failed to allocate I/O job\n");
+		return (NULL);
+	}
+	job->type = type;
+	job->conn = conn;
+	job->submit_usec = get_time_usec();
+	return (job);
+}
+
+// Queue the job for the I/O pool. If the pool does not run or its queue is full, the job is run right away instead.
+// Returns 1 if the job is queued, 0 if it is done.
+int	io_job_submit(io_job_t *job)
+{
+#ifdef __linux__
+	pthread_mutex_lock(&g_io_pool.lock);
+	if (g_io_pool.thread_count > 0 && g_io_pool.queued < IO_QUEUE_MAX)
+	{
+		job->next = NULL;
+		if (g_io_pool.queue_tail)
+			g_io_pool.queue_tail->next = job;
+		else
+			g_io_pool.queue_head = job;
+		g_io_pool.queue_tail = job;
+		g_io_pool.queued++;
+		pthread_cond_signal(&g_io_pool.has_jobs);
+		pthread_mutex_unlock(&g_io_pool.lock);
+		return (1);
+	}
+	pthread_mutex_unlock(&g_io_pool.lock);
+#endif
+	io_job_run(job);
+	io_stats_add(job, 1);
+	return (0);
+}
+
+void	print_server_stats()
+{
+	printf ("WORKER %d CACHE: %zu hits, %zu misses, %zu evictions, %zu invalidations, %zu entries, %zu/%zu bytes\n",
+		(int)getpid(), g_content_cache.hits, g_content_cache.misses, g_content_cache.evictions,
+		g_content_cache.invalidations, g_content_cache.entry_count, g_content_cache.bytes, g_config.cache_size);
+	printf ("WORKER %d FD CACHE: %zu hits, %zu misses, %zu/%zu open files\n",
+		(int)getpid(), g_fd_cache.hits, g_fd_cache.misses, g_fd_cache.entry_count, g_config.fd_cache_max);
+	for (int type = 0; type < IO_TYPE_COUNT; type++)
+	{
+		io_stats_t	*stats = &g_io_stats[type];
+		if (stats->count == 0)
+			continue ;
+		printf ("WORKER %d I/O %s: %zu jobs, %zu inline, %zu us average wait, %zu us average run, %zu us max run\n",
+			(int)getpid(), g_io_type_names[type], stats->count, stats->inline_count, stats->wait_usec / stats->count,
+			stats->run_usec / stats->count, stats->max_run_usec);
+	}
+#ifdef HAVE_IO_URING
+	if (uring_running())
+		printf ("WORKER %d IO_URING: %zu enters, %zu completions, %d/%d free buffers, %d fixed file slots free\n",
+			(int)getpid(), g_uring.enters, g_uring.completions, g_uring.free_buffers, URING_BUFFER_COUNT,
+			g_uring.free_slot_count);
+#endif
+	fflush(stdout);
+}
+
+// Header buffers of MAX_HTTP_MSG_HEADER_SIZE + 1 bytes, given back by the connections that wait for their next
+// request with nothing received, so idle keep-alive connections hold no buffer.
+// Buffers are reused as they are: only the bytes received are ever read, so they are never cleared.
+typedef struct header_pool_t
+{
+	char	*free[HEADER_POOL_MAX];
+	int		free_count;
+}	header_pool_t;
+
+header_pool_t	g_header_pool;
+
+// Returns a header buffer, from the pool if it has one, or NULL if not successful.
+char	*header_buffer_get()
+{
+	if (g_header_pool.free_count > 0)
+		return (g_header_pool.free[--g_header_pool.free_count]);
+	char	*buffer = (char *)malloc(MAX_HTTP_MSG_HEADER_SIZE + 1);
+	if (buffer == NULL)
+		ERROR_PRTF ("SERVER ERROR: Failed to allocate HTTP request header buffer\n");
+	return (buffer);
+}
+
+void	header_buffer_put(char *buffer)
+{
+	if (buffer == NULL)
+		return ;
+	if (g_header_pool.free_count < HEADER_POOL_MAX)
+		g_header_pool.free[g_header_pool.free_count++] = buffer;
+	else
+		free (buffer);
+}
+
+// Connection state for the event loop.
+// Every request goes READING_HEADER -> (READING_BODY) and its response is queued, then the connection
+// goes back to READING_HEADER for the next request (keep-alive), or to CLOSING to send what is queued and close.
+// A connection the server closes goes on to LINGERING, to discard what the client still sends before it is closed.
+typedef enum conn_state_t
+{
+	CONN_READING_HEADER,
+	CONN_READING_BODY,
+	CONN_CLOSING,
+	CONN_LINGERING
+}	conn_state_t;
+
+// A serialized response waiting to be sent. Responses are queued in the order of the requests.
+// Segments point into the arena of the connection or into a cache entry, never to a copy of the body.
+// The memory segments are sent first, then file_remaining bytes of file from file_offset, with sendfile().
+typedef struct out_item_t
+{
+	struct iovec		segs[MAX_OUT_SEGMENTS];
+	int					seg_count;
+	int					seg_idx; // First segment not completely sent.
+	cache_entry_t		*cache_entry; // Cached response that segments may point to, released with the item.
+	open_file_t			*file; // File the body is sent from, NULL if the whole response is in memory.
+	off_t				file_offset;
+	size_t				file_remaining;
+	struct out_item_t	*next;
+}	out_item_t;
+
+// Connections of a worker, in the order they were last active.
+typedef struct conn_list_t
+{
+	struct conn_t	*head;
+	struct conn_t	*tail;
+}	conn_list_t;
+
+#ifdef HAVE_IO_URING
+// State of a connection served by the io_uring engine.
+// The bytes received stay in the buffers of the ring until they are taken, and one send at a time is in flight.
+typedef struct uring_conn_t
+{
+	int				ops; // Operations in flight that use the connection, which is only freed once there are none.
+	int				recv_armed; // A multishot receive is armed.
+	int				recv_cancelled; // Its cancellation was submitted.
+	int				rx_head; // First buffer of bytes received and not taken yet, -1 if none.
+	int				rx_tail;
+	size_t			rx_offset; // Bytes of rx_head already taken.
+	int				rx_count; // Buffers held.
+	int				rx_eof; // The client stopped sending.
+	int				rx_error; // errno of the receive, if it failed.
+	int				sending; // A send is in flight.
+	int				send_file; // It sends from the pipe, that file bodies are spliced into.
+	int				pipe_fds[2]; // Created on the first file body, -1 until then.
+	size_t			pipe_size;
+	size_t			pipe_len; // Bytes of the file body of the first response in the pipe, not sent yet.
+	int				splice_res; // Result of the splice into the pipe.
+	int				polling; // A poll of the socket is armed.
+	struct msghdr	msg;
+	struct iovec	iov[MAX_IOVECS];
+	int				starved; // The connection is in the starved list of the ring.
+	struct conn_t	*starved_next;
+}	uring_conn_t;
+#endif
+
+typedef struct conn_t
+{
+	int				sock;
+	conn_state_t	state;
+	char			client_ip[INET_ADDRSTRLEN];
+	unsigned int	client_port;
+
+	char			*header_buffer; // From the header pool, NULL while nothing of the next request is received.
+	size_t			header_len;
+	size_t			header_scanned; // Bytes of header_buffer already searched for the end of the header.
+	size_t			header_end; // Offset right after "\r\n\r\n", 0 if not received yet.
+	size_t			request_end; // Offset of the first byte after the current request.
+	http_request_t	request; // Current request, parsed in place in header_buffer.
+
+	arena_t			arena; // Backs the queued responses, reset once they are all sent.
+
+	char			*body_buffer; // Chunk of the body being received, BODY_CHUNK_SIZE bytes.
+	size_t			body_size;
+	size_t			body_received;
+	upload_t		*upload; // Upload the body is streamed to, NULL if the body is discarded.
+
+	out_item_t		*out_head;
+	out_item_t		*out_tail;
+	int				out_count;
+	char			*send_chunk; // File bodies not sent with sendfile() go through it, send_chunk_size bytes, allocated on first use.
+
+	io_job_t		*io_job; // Job of the I/O pool the connection waits for, NULL if none.
+	io_job_t		*io_results; // Files opened and read for the current request, kept until its response is queued.
+	int				handling; // The current request is complete, and its handler waits for the I/O pool.
+	int				io_event; // The socket had an event while the connection waited for the I/O pool.
+	int				closed; // The connection was closed while it waited for the I/O pool, and is freed once it is done.
+#ifdef HAVE_IO_URING
+	uring_conn_t	uring;
+#endif
+
+	int				keep_alive; // Keep the connection open after the current response.
+	int				linger; // The server closes the connection, so it lingers once its responses are sent.
+	int				request_count;
+	size_t			last_active_msec;
+	conn_list_t		*list; // List of connections ordered by activity the connection is in, NULL if none.
+	struct conn_t	*prev; // Neighbours in that list.
+	struct conn_t	*next;
+}	conn_t;
+
+int	set_nonblocking(int sock)
+{
+	int	flags = fcntl(sock, F_GETFL, 0);
+
+	if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1)
+		return (-1);
+	return (0);
+}
+
+// Create the state of a newly accepted connection.
+// Returns NULL if not successful.
+conn_t	*conn_create(int client_sock)
+{
+	conn_t	*conn = (conn_t *)calloc(1, sizeof(conn_t));
+	if (conn == NULL)
+	{
+		ERROR_PRTF ("SERVER ERROR: Failed to allocate connection\n");
+		return (NULL);
+	}
+	conn->sock = client_sock;
+	conn->state = CONN_READING_HEADER;
+#ifdef HAVE_IO_URING
+	conn->uring.rx_head = -1;
+	conn->uring.rx_tail = -1;
+	conn->uring.pipe_fds[0] = -1;
+	conn->uring.pipe_fds[1] = -1;
+#endif
+
+	struct sockaddr_in client_addr_info;
+	socklen_t client_addr_info_len = sizeof(client_addr_info);
+	if (getpeername(client_sock, (struct sockaddr*)&client_addr_info, &client_addr_info_len) == 0)
+	{
+		conn->client_port = ntohs(client_addr_info.sin_port);
+		inet_ntop(AF_INET, &(client_addr_info.sin_addr), conn->client_ip, INET_ADDRSTRLEN);
+	}
+	printf ("CLIENT %s:%u ", conn->client_ip, conn->client_port);
+	GREEN_PRTF ("CONNECTED.\n");
+	return (conn);
+}
+
+void	free_out_item(out_item_t *item)
+{
+	open_file_release (item->file);
+	cache_entry_release (item->cache_entry);
+	free (item);
+}
+
+// Append a memory segment to be sent with the item. Empty segments are skipped.
+void	out_item_add_segment(out_item_t *item, void *base, size_t len)
+{
+	if (len == 0)
+		return ;
+	item->segs[item->seg_count].iov_base = base;
+	item->segs[item->seg_count].iov_len = len;
+	item->seg_count++;
+}
+
+// Allocate an empty response and append it to the output queue of the connection.
+// Returns NULL if not successful.
+out_item_t	*conn_add_out_item(conn_t *conn)
+{
+	out_item_t	*item = (out_item_t *)calloc(1, sizeof(out_item_t));
+	if (item == NULL)
+	{
+		ERROR_PRTF ("SERVER ERROR: Failed to allocate HTTP response\n");
+		return (NULL);
+	}
+	if (conn->out_tail)
+		conn->out_tail->next = item;
+	else
+		conn->out_head = item;
+	conn->out_tail = item;
+	conn->out_count++;
+	return (item);
+}
+
+#ifdef HAVE_IO_URING
+// Give back the buffers the connection holds, close its pipe, and take it out of the starved list.
+void	uring_release_conn(conn_t *conn)
+{
+	uring_conn_t	*uc = &conn->uring;
+
+	if (uc->pipe_fds[0] != -1)
+	{
+		close(uc->pipe_fds[0]);
+		close(uc->pipe_fds[1]);
+	}
+	while (uc->rx_head != -1)
+	{
+		int	bid = uc->rx_head;
+		uc->rx_head = g_uring.buf_next[bid];
+		uring_recycle_buffer(bid);
+	}
+	if (!uc->starved)
+		return ;
+	conn_t	**link = &g_uring.starved;
+	while (*link != conn)
+		link = &(*link)->uring.starved_next;
+	*link = uc->starved_next;
+}
+
+// Have the loop arm the receive of the connection again, along with the starved connections.
+void	uring_arm_later(conn_t *conn)
+{
+	uring_conn_t	*uc = &conn->uring;
+
+	if (uc->starved)
+		return ;
+	uc->starved = 1;
+	uc->starved_next = g_uring.starved;
+	g_uring.starved = conn;
+}
+#endif
+
+// Free the state of a connection. Does not close the socket.
+void	conn_destroy(conn_t *conn)
+{
+	if (conn == NULL)
+		return ;
+#ifdef HAVE_IO_URING
+	uring_release_conn(conn);
+#endif
+	printf ("CLIENT %s:%u ", conn->client_ip, conn->client_port);
+	GREEN_PRTF ("DISCONNECTED.\n\n");
+	header_buffer_put (conn->header_buffer);
+	free (conn->body_buffer);
+	free (conn->send_chunk);
+	upload_free (conn->upload);
+	io_job_free (conn->io_results);
+	arena_free (&conn->arena);
+	while (conn->out_head != NULL)
+	{
+		out_item_t	*item = conn->out_head;
+		conn->out_head = item->next;
+		free_out_item (item);
+	}
+	free (conn);
+}
+
+// Run the job for the connection, in the I/O pool if possible.
+// Returns 1 if the connection waits for the job, 0 if it is already done.
+int	conn_run_io(conn_t *conn, io_job_t *job)
+{
+	conn->io_job = job;
+	conn->io_event = 0;
+	if (io_job_submit(job))
+		return (1);
+	conn->io_job = NULL;
+	return (0);
+}
+
+// Apply the result of a job done for the connection, in the event loop thread.
+// Files opened and read are kept in io_results for the handler of the current request, the other jobs are freed.
+// Returns 1 if the connection can go on, 0 if it waits for the socket, -1 if it should be closed.
+int	conn_io_done(conn_t *conn, io_job_t *job)
+{
+	if (job->type == IO_OPEN || job->type == IO_READ)
+	{
+		if (job->type == IO_OPEN)
+			job->file = fd_cache_end(&job->check);
+		job->next = conn->io_results;
+		conn->io_results = job;
+		return (1);
+	}
+	ssize_t	ret = job->ret;
+	int		error = job->error;
+	int		type = job->type;
+	io_job_free(job);
+	if (type == IO_UPLOAD)
+	{
+		upload_invalidate_cache(conn->upload);
+		return (ret == -1 ? -1 : 1);
+	}
+#ifdef HAVE_IO_URING
+	// The socket is blocking again for the sends of the ring, see uring_splice_ready().
+	if (uring_running())
+		fcntl(conn->sock, F_SETFL, fcntl(conn->sock, F_GETFL, 0) & ~O_NONBLOCK);
+#endif
+	if (ret > 0)
+		conn->body_received += ret;
+	else if (ret == 0)
+	{
+		// The client will not send more requests, but may still wait for the queued responses.
+		conn->state = CONN_CLOSING;
+	}
+	else if (error == EAGAIN || error == EWOULDBLOCK)
+		return (0);
+	else if (error != EINTR)
+	{
+		ERROR_PRTF ("SERVER ERROR: Failed to read HTTP request\n");
+		return (-1);
+	}
+	return (1);
+}
+
+// Get the open file at path for the current request, like fd_cache_open(), with the disk part done by the I/O pool.
+// Sets *file to the file with one reference for the caller, NULL if it does not exist or an error occurs.
+// Returns 1 if *file is set, 0 if the connection waits for the I/O pool.
+int	conn_open_file(conn_t *conn, char *path, open_file_t **file)
+{
+	for (io_job_t *job = conn->io_results; job != NULL; job = job->next)
+	{
+		if (job->type == IO_OPEN && strcmp(job->check.path, path) == 0)
+		{
+			*file = job->file;
+			if (*file != NULL)
+				(*file)->refcount++;
+			return (1);
+		}
+	}
+	file_check_t	check;
+	if (fd_cache_begin(path, &check, file))
+		return (1);
+	io_job_t	*job = io_job_create(conn, IO_OPEN);
+	if (job == NULL)
+	{
+		check_file(&check);
+		*file = fd_cache_end(&check);
+		return (1);
+	}
+	job->check = check;
+	if (conn_run_io(conn, job))
+		return (0);
+	conn_io_done(conn, job);
+	return (conn_open_file(conn, path, file));
+}
+
+// Read the whole open file for the current request, like load_open_file(), in the I/O pool.
+// Sets *body to the bytes read (and compressed if compress is set) for the caller to free, NULL if not successful.
+// Returns 1 if *body is set, 0 if the connection waits for the I/O pool.
+int	conn_load_file(conn_t *conn, open_file_t *file, int compress, char **body, size_t *body_size)
+{
+	for (io_job_t *job = conn->io_results; job != NULL; job = job->next)
+	{
+		if (job->type == IO_READ && job->file == file && job->compress == compress)
+		{
+			*body = job->body;
+			*body_size = job->body_size;
+			job->body = NULL;
+			return (1);
+		}
+	}
+	io_job_t	*job = io_job_create(conn, IO_READ);
+	if (job == NULL)
+	{
+		*body = NULL;
+		return (1);
+	}
+	file->refcount++;
+	job->file = file;
+	job->compress = compress;
+	if (conn_run_io(conn, job))
+		return (0);
+	conn_io_done(conn, job);
+	return (conn_load_file(conn, file, compress, body, body_size));
+}
+
+// Format the value of the Keep-Alive field for the current response of the connection.
+void	format_keep_alive(conn_t *conn, char *buffer)
+{
+	sprintf(buffer, "timeout=%d, max=%d", g_config.keepalive_timeout, g_config.keepalive_max - conn->request_count);
+}
+
+// Serialize the response and append it to the output queue of the connection.
+// The body of the response is sent after it from the file_len bytes of file at file_offset (with its
+// Content-Length field already set), unless file is NULL. response is allocated from the arena of the connection.
+// Takes the reference to file.
+// Returns 1 if successful, -1 if not.
+int	conn_queue_file_response(conn_t *conn, http_t *response, open_file_t *file, off_t file_offset, size_t file_len)
+{
+	if (response == NULL)
+	{
+		open_file_release(file);
+		return (-1);
+	}
+	if (conn->keep_alive)
+	{
+		char	keep_alive[64];
+		format_keep_alive(conn, keep_alive);
+		arena_add_field_to_http (&conn->arena, response, "Connection", "keep-alive");
+		arena_add_field_to_http (&conn->arena, response, "Keep-Alive", keep_alive);
+	}
+	else
+		arena_add_field_to_http (&conn->arena, response, "Connection", "close");
+	printf ("\tHTTP ");
+	GREEN_PRTF ("RESPONSE:\n");
+	print_http_header (response);
+
+	// Parse http response to the arena. The body stays where it is, and goes out in the same sendmsg().
+	size_t		header_size = http_header_size(response);
+	char		*header = (char *)arena_alloc(&conn->arena, header_size);
+	out_item_t	*item = header ? conn_add_out_item(conn) : NULL;
+	if (item == NULL)
+	{
+		ERROR_PRTF ("SERVER ERROR: Failed to write HTTP response to buffer\n");
+		open_file_release(file);
+		return (-1);
+	}
+	serialize_http_header(response, header);
+	item->file = file;
+	item->file_offset = file_offset;
+	item->file_remaining = file != NULL ? file_len : 0;
+	out_item_add_segment(item, header, header_size);
+	out_item_add_segment(item, response->body_data, response->body_size);
+	return (1);
+}
+
+// Append a response that is already serialized to the output queue of the connection. Only the Connection
+// fields are formatted for the request, between header (without its final CRLF) and body, which are not copied.
+// Returns the queued item, NULL if not successful.
+out_item_t	*conn_queue_serialized_response(conn_t *conn, char *header, size_t header_size, char *body, size_t body_size)
+{
+	char		*fields = (char *)arena_alloc(&conn->arena, 128);
+	out_item_t	*item = fields ? conn_add_out_item(conn) : NULL;
+	if (item == NULL)
+		return (NULL);
+	if (conn->keep_alive)
+	{
+		char	keep_alive[64];
+		format_keep_alive(conn, keep_alive);
+		sprintf(fields, "Connection: keep-alive\r\nKeep-Alive: %s\r\n\r\n", keep_alive);
+	}
+	else
+		strcpy(fields, "Connection: close\r\n\r\n");
+	out_item_add_segment(item, header, header_size);
+	out_item_add_segment(item, fields, strlen(fields));
+	out_item_add_segment(item, body, body_size);
+	return (item);
+}
+
+// Append the cached response to the output queue of the connection.
+// The header and body are sent from the cache entry, which is kept alive until then.
+// Returns 1 if successful, -1 if not.
+int	conn_queue_cached_response(conn_t *conn, cache_entry_t *entry)
+{
+	out_item_t	*item = conn_queue_serialized_response(conn, entry->header, entry->header_size, entry->body, entry->body_size);
+	if (item == NULL)
+		return (-1);
+	printf ("\tHTTP ");
+	GREEN_PRTF ("RESPONSE:\n");
+	printf ("\t\tCACHED %s (%zu bytes)\n", entry->path, entry->body_size);
+	item->cache_entry = entry;
+	entry->refcount++;
+	return (1);
+}
+
+// Serialize the response, body included, and append it to the output queue of the connection.
+// Returns 1 if successful, -1 if not.
+int	conn_queue_response(conn_t *conn, http_t *response)
+{
+	return (conn_queue_file_response(conn, response, NULL, 0, 0));
+}
+
+// Creates a text/html response with a fixed body, used for the error statuses, allocated from arena.
+// Returns NULL if not successful.
+http_t	*create_html_response(arena_t *arena, char *status, char *body, size_t body_size)
+{
+	http_t	*response = arena_init_http_with_arg (arena, NULL, NULL, HTTP_VERSION, status);
+
+	if (response == NULL)
+	{
+		ERROR_PRTF ("SERVER ERROR: Failed to create HTTP response\n");
+		return (NULL);
+	}
+	if (arena_add_field_to_http (arena, response, "Content-Type", "text/html") == -1
+		|| arena_add_body_to_http (arena, response, body_size, body) == -1)
+		return (NULL);
+	return (response);
+}
+
+// Responses with a fixed body, serialized once at startup by init_canned_responses().
+typedef enum canned_id_t
+{
+	CANNED_400,
+	CANNED_400_METHOD, // Unsupported method. Its body has always said 404.
+	CANNED_401,
+	CANNED_404,
+	CANNED_431,
+	CANNED_COUNT
+}	canned_id_t;
+
+typedef struct canned_response_t
+{
+	char	*status;
+	char	*body;
+	char	*www_authenticate; // Value of the WWW-Authenticate field, NULL if none.
+	char	*header; // Serialized header, without the Connection fields and the final CRLF.
+	size_t	header_size;
+	size_t	body_size;
+}	canned_response_t;
+
+canned_response_t	g_canned_responses[CANNED_COUNT] = {
+	[CANNED_400] = {"400", "<html><body><h1>400 Bad Request</h1></body></html>", NULL},
+	[CANNED_400_METHOD] = {"400", "<html><body><h1>404 Bad Request</h1></body></html>", NULL},
+	[CANNED_401] = {"401", "<html><body><h1>401 Unauthorized</h1></body></html>", "Basic realm=\"ID & Password?\""},
+	[CANNED_404] = {"404", "<html><body><h1>404 Not Found</h1></body></html>", NULL},
+	[CANNED_431] = {"431", "<html><body><h1>431 Request Header Fields Too Large</h1></body></html>", NULL},
+};
+
+// Serialize the headers of the canned responses.
+// The body is sent with its terminating NUL, as it always was.
+// Returns 0 if successful, -1 if not.
+int	init_canned_responses()
+{
+	arena_t	arena = {NULL};
+	int		ret = 0;
+
+	for (int i = 0; i < CANNED_COUNT && ret == 0; i++)
+	{
+		canned_response_t	*canned = &g_canned_responses[i];
+		canned->body_size = strlen(canned->body) + 1;
+		http_t	*response = create_html_response (&arena, canned->status, canned->body, canned->body_size);
+		if (response == NULL || (canned->www_authenticate != NULL
+			&& arena_add_field_to_http (&arena, response, "WWW-Authenticate", canned->www_authenticate) == -1))
+			ret = -1;
+		ssize_t	header_size = ret == 0 ? write_http_header_to_buffer (response, (void **)&canned->header) : -1;
+		if (header_size == -1)
+		{
+			ERROR_PRTF ("SERVER ERROR: Failed to create canned HTTP responses\n");
+			ret = -1;
+		}
+		// The blank line comes after the Connection fields, which depend on the request.
+		canned->header_size = header_size - 2;
+		arena_reset (&arena);
+	}
+	arena_free (&arena);
+	return (ret);
+}
+
+// Append the canned response to the output queue of the connection.
+// Returns 1 if successful, -1 if not.
+int	conn_queue_canned_response(conn_t *conn, canned_id_t id)
+{
+	canned_response_t	*canned = &g_canned_responses[id];
+
+	if (conn_queue_serialized_response(conn, canned->header, canned->header_size, canned->body, canned->body_size) == NULL)
+		return (-1);
+	printf ("\tHTTP ");
+	GREEN_PRTF ("RESPONSE:\n");
+	printf ("\t\tHTTP/1.1 %s (canned)\n", canned->status);
+	return (1);
+}
+
+// What the server does with a request path, from the routing table.
+typedef enum route_kind_t
+{
+	ROUTE_STATIC, // Any other file under SERVER_ROOT.
+	ROUTE_PROTECTED, // File that needs authorization.
+	ROUTE_UPLOAD, // Target of the POST requests that upload an image to the album.
+	ROUTE_INDEX // Directory served with its INDEX_FILE.
+}	route_kind_t;
+
+// Cache-Control of the files under a path prefix of the requests.
+typedef struct cache_policy_t
+{
+	char	*prefix;
+	char	*cache_control;
+}	cache_policy_t;
+
+// The first matching prefix applies, so longer prefixes come first. Protected files are always private.
+cache_policy_t	g_cache_policies[] = {
+	{"/public/album/album_images.html", "no-cache"}, // Changes with every upload.
+	{"/public/", g_static_cache_control},
+	{"/", "no-cache"},
+};
+
+// Returns the Cache-Control of the file at request_path, routed as route.
+char	*find_cache_control(char *request_path, route_kind_t route)
+{
+	if (route == ROUTE_PROTECTED)
+		return ("private, no-cache");
+	for (size_t i = 0; i < sizeof(g_cache_policies) / sizeof(g_cache_policies[0]); i++)
+	{
+		if (strncmp(request_path, g_cache_policies[i].prefix, strlen(g_cache_policies[i].prefix)) == 0)
+			return (g_cache_policies[i].cache_control);
+	}
+	return ("no-cache");
+}
+
+// Returns the mask (1 << coding) of the content codings an Accept-Encoding field accepts with a q-value above 0.
+// "*" stands for the codings the field does not name, and identity is accepted unless refused.
+int	accepted_codings(char *accept_encoding)
+{
+	int	named = 0;
+	int	accepted = 0;
+	int	star = -1; // q-value of "*" above 0, or -1 without one.
+
+	if (accept_encoding == NULL)
+		return (1 << CODING_IDENTITY);
+	for (char *c = accept_encoding + strspn(accept_encoding, " \t,"); *c != '\0'; c += strspn(c, " \t,"))
+	{
+		size_t	len = strcspn(c, " \t,;");
+		char	*params = c + len;
+		char	*q = strstr(params, "q=");
+		int		weight = q == NULL || q - params > (long)strcspn(params, ",") || strtod(q + 2, NULL) > 0;
+		if (len == 1 && *c == '*')
+			star = weight;
+		for (int coding = 0; coding < CODING_COUNT; coding++)
+		{
+			if ((strlen(g_coding_names[coding]) == len && strncasecmp(c, g_coding_names[coding], len) == 0)
+				|| (coding == CODING_GZIP && len == 6 && strncasecmp(c, "x-gzip", len) == 0))
+			{
+				named |= 1 << coding;
+				accepted |= weight << coding;
+			}
+		}
+		c = params + strcspn(params, ",");
+	}
+	if (star == 1)
+		accepted |= ((1 << CODING_COUNT) - 1) & ~named;
+	if (!(named & (1 << CODING_IDENTITY)) && star != 0)
+		accepted |= 1 << CODING_IDENTITY;
+	return (accepted);
+}
+
+// Write the ETag of file in coding to etag (sizeof(file->etag) + 8 bytes): each coding is a representation
+// of its own, so the coding is added to the validator of the file.
+void	make_coding_etag(open_file_t *file, content_coding_t coding, char *etag)
+{
+	if (coding == CODING_IDENTITY)
+		strcpy(etag, file->etag);
+	else
+		sprintf(etag, "%.*s-%s\"", (int)strlen(file->etag) - 1, file->etag, g_coding_names[coding]);
+}
+
+// Add the validators of file in coding and cache_control to response, and a Vary field
+// if the coding of the file depends on Accept-Encoding.
+// Returns 0 if successful, -1 if not.
+int	add_cache_fields(arena_t *arena, http_t *response, open_file_t *file, content_coding_t coding, char *cache_control)
+{
+	char	etag[sizeof(file->etag) + 8];
+
+	make_coding_etag(file, coding, etag);
+	if (arena_add_field_to_http (arena, response, "ETag", etag) == -1
+		|| arena_add_field_to_http (arena, response, "Last-Modified", file->last_modified) == -1
+		|| arena_add_field_to_http (arena, response, "Cache-Control", cache_control) == -1)
+		return (-1);
+	if (is_compressible_type(get_file_extension(file->path))
+		&& arena_add_field_to_http (arena, response, "Vary", "Accept-Encoding") == -1)
+		return (-1);
+	return (0);
+}
+
+// Returns 1 if the If-None-Match list holds "*" or etag, compared weakly (ignoring "W/"), 0 if not.
+int	etag_list_matches(char *list, char *etag)
+{
+	size_t	etag_len = strlen(etag);
+
+	for (char *c = list + strspn(list, " \t,"); *c != '\0'; c += strspn(c, " \t,"))
+	{
+		if (*c == '*')
+			return (1);
+		if (strncmp(c, "W/", 2) == 0)
+			c += 2;
+		char	*end = *c == '"' ? strchr(c + 1, '"') : NULL;
+		size_t	len = end != NULL ? (size_t)(end + 1 - c) : strcspn(c, " \t,");
+		if (len == etag_len && strncmp(c, etag, len) == 0)
+			return (1);
+		c += len;
+	}
+	return (0);
+}
+
+// Returns 1 if the conditional fields of the request show that the client has the current version of file
+// in coding, 0 if not. If-Modified-Since only counts without If-None-Match.
+int	request_not_modified(http_request_t *request, open_file_t *file, content_coding_t coding)
+{
+	char	*if_none_match = request_header(request, HDR_IF_NONE_MATCH);
+	char	*if_modified_since = request_header(request, HDR_IF_MODIFIED_SINCE);
+	char	etag[sizeof(file->etag) + 8];
+	time_t	date;
+
+	make_coding_etag(file, coding, etag);
+	if (if_none_match != NULL)
+		return (etag_list_matches(if_none_match, etag));
+	return (if_modified_since != NULL && parse_http_date(if_modified_since, &date) == 0 && file->mtime <= date);
+}
+
+// Returns 1 if the Range field of the request applies to file: it has no If-Range field,
+// or its If-Range field holds the ETag or the exact Last-Modified date of file. 0 if not.
+int	request_range_applies(http_request_t *request, open_file_t *file)
+{
+	char	*if_range = request_header(request, HDR_IF_RANGE);
+	time_t	date;
+
+	if (if_range == NULL)
+		return (1);
+	if (if_range[0] == '"')
+		return (strcmp(if_range, file->etag) == 0);
+	return (parse_http_date(if_range, &date) == 0 && date == file->mtime);
+}
+
+// Queue a 304 Not Modified response for file in coding. Takes the reference to file.
+// Returns 1 if successful, -1 if not.
+int	queue_not_modified_response(conn_t *conn, open_file_t *file, content_coding_t coding, char *cache_control)
+{
+	http_t	*response = arena_init_http_with_arg (&conn->arena, NULL, NULL, HTTP_VERSION, "304");
+
+	if (response == NULL || add_cache_fields(&conn->arena, response, file, coding, cache_control) == -1)
+	{
+		ERROR_PRTF ("SERVER ERROR: Failed to create HTTP response\n");
+		open_file_release(file);
+		return (-1);
+	}
+	open_file_release(file);
+	return (conn_queue_file_response(conn, response, NULL, 0, 0));
+}
+
+// Range of bytes of a file, from first to last included.
+typedef struct byte_range_t
+{
+	off_t	first;
+	off_t	last;
+}	byte_range_t;
+
+// Number of the multipart/byteranges responses sent by this worker, to make their boundaries.
+size_t	g_byteranges_count;
+
+// Parse the "bytes=" Range field of a request for a file of file_size bytes into ranges (MAX_RANGES entries).
+// Returns the number of satisfiable ranges, 0 if none is, or -1 if the field is to be ignored: malformed,
+// with more than MAX_RANGES ranges, or asking for more bytes than the whole file.
+int	parse_byte_ranges(char *field, off_t file_size, byte_range_t *ranges)
+{
+	int		count = 0;
+	off_t	total = 0;
+
+	if (strncasecmp(field, "bytes=", 6) != 0)
+		return (-1);
+	for (char *c = field + 6; ; c++)
+	{
+		off_t	first = -1;
+		off_t	last = -1;
+		c += strspn(c, " \t");
+		if (isdigit((unsigned char)*c))
+			first = strtoll(c, &c, 10);
+		if (*c++ != '-')
+			return (-1);
+		if (isdigit((unsigned char)*c))
+			last = strtoll(c, &c, 10);
+		if ((first == -1 && last == -1) || (last != -1 && last < first))
+			return (-1);
+		// "-n" asks for the last n bytes, "n-" for the bytes from n, and the last byte is clamped to the file.
+		if (first == -1)
+		{
+			first = last < file_size ? file_size - last : 0;
+			last = last > 0 ? file_size - 1 : -1;
+		}
+		else if (last == -1 || last >= file_size)
+			last = file_size - 1;
+		if (first < file_size && first <= last)
+		{
+			total += last - first + 1;
+			if (count == MAX_RANGES || total > file_size)
+				return (-1);
+			ranges[count].first = first;
+			ranges[count].last = last;
+			count++;
+		}
+		c += strspn(c, " \t");
+		if (*c == '\0')
+			return (count);
+		if (*c != ',')
+			return (-1);
+	}
+}
+
+// Queue a response with the bytes of file in ranges (range_count of them), of the type of file_ext:
+// 206 Partial Content with a single range or a multipart/byteranges body, 416 Range Not Satisfiable without any.
+// The bytes are sent from the file with sendfile(). Takes the reference to file.
+// Returns 1 if successful, -1 if not.
+int	queue_range_response(conn_t *conn, open_file_t *file, char *file_ext, char *cache_control,
+	byte_range_t *ranges, int range_count)
+{
+	char	*type = find_content_type(file_ext);
+	char	content_range[96];
+	char	content_length[32];
+	http_t	*response = arena_init_http_with_arg (&conn->arena, NULL, NULL, HTTP_VERSION, range_count > 0 ? "206" : "416");
+
+	if (response == NULL)
+	{
+		ERROR_PRTF ("SERVER ERROR: Failed to create HTTP response\n");
+		open_file_release(file);
+		return (-1);
+	}
+	arena_add_field_to_http (&conn->arena, response, "Accept-Ranges", "bytes");
+	if (range_count == 0)
+	{
+		sprintf(content_range, "bytes */%lld", (long long)file->size);
+		arena_add_field_to_http (&conn->arena, response, "Content-Range", content_range);
+		arena_add_field_to_http (&conn->arena, response, "Content-Length", "0");
+		open_file_release(file);
+		return (conn_queue_file_response(conn, response, NULL, 0, 0));
+	}
+	add_cache_fields(&conn->arena, response, file, CODING_IDENTITY, cache_control);
+	if (range_count == 1)
+	{
+		off_t	len = ranges[0].last - ranges[0].first + 1;
+		sprintf(content_range, "bytes %lld-%lld/%lld", (long long)ranges[0].first, (long long)ranges[0].last, (long long)file->size);
+		sprintf(content_length, "%lld", (long long)len);
+		arena_add_field_to_http (&conn->arena, response, "Content-Type", type);
+		arena_add_field_to_http (&conn->arena, response, "Content-Range", content_range);
+		arena_add_field_to_http (&conn->arena, response, "Content-Length", content_length);
+		return (conn_queue_file_response(conn, response, file, ranges[0].first, len));
+	}
+	// Every range is sent from the file after its own part header, and the body ends with the last boundary.
+	char	boundary[32];
+	char	*part_headers[MAX_RANGES];
+	char	*end = (char *)arena_alloc(&conn->arena, 64);
+	off_t	total = 0;
+	sprintf(boundary, "%020zu", ++g_byteranges_count);
+	for (int i = 0; i < range_count; i++)
+	{
+		part_headers[i] = (char *)arena_alloc(&conn->arena, 160 + strlen(type));
+		if (part_headers[i] == NULL || end == NULL)
+		{
+			open_file_release(file);
+			return (-1);
+		}
+		sprintf(part_headers[i], "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n", boundary, type,
+			(long long)ranges[i].first, (long long)ranges[i].last, (long long)file->size);
+		total += strlen(part_headers[i]) + ranges[i].last - ranges[i].first + 1;
+	}
+	sprintf(end, "\r\n--%s--\r\n", boundary);
+	total += strlen(end);
+	sprintf(content_length, "%lld", (long long)total);
+	char	content_type[64];
+	sprintf(content_type, "multipart/byteranges; boundary=%s", boundary);
+	arena_add_field_to_http (&conn->arena, response, "Content-Type", content_type);
+	arena_add_field_to_http (&conn->arena, response, "Content-Length", content_length);
+	if (conn_queue_file_response(conn, response, NULL, 0, 0) == -1)
+	{
+		open_file_release(file);
+		return (-1);
+	}
+	for (int i = 0; i <= range_count; i++)
+	{
+		out_item_t	*item = conn_add_out_item(conn);
+		if (item == NULL)
+		{
+			open_file_release(file);
+			return (-1);
+		}
+		if (i == range_count)
+		{
+			out_item_add_segment(item, end, strlen(end));
+			break ;
+		}
+		out_item_add_segment(item, part_headers[i], strlen(part_headers[i]));
+		item->file = file;
+		item->file_offset = ranges[i].first;
+		item->file_remaining = ranges[i].last - ranges[i].first + 1;
+		file->refcount++;
+	}
+	open_file_release(file);
+	return (1);
+}
+
+// Pick the coding of the body of file for the current request of the connection, which accepts the codings
+// in the mask accepted: a precompressed sidecar first, then gzip compressed by the server, else the file as it is.
+// Sets *sidecar to the open sidecar the body is sent from, or NULL if it is made from file.
+// Returns the coding, or -1 if the connection waits for the I/O pool to open a sidecar.
+int	choose_coding(conn_t *conn, open_file_t *file, int accepted, open_file_t **sidecar)
+{
+	*sidecar = NULL;
+	for (int coding = CODING_IDENTITY + 1; coding < CODING_COUNT; coding++)
+	{
+		if (!(file->sidecars & accepted & (1 << coding)))
+			continue ;
+		char	sidecar_path[MAX_PATH_SIZE + 8];
+		snprintf(sidecar_path, sizeof(sidecar_path), "%s%s", file->path, g_coding_suffixes[coding]);
+		if (!conn_open_file(conn, sidecar_path, sidecar))
+			return (-1);
+		if (*sidecar != NULL)
+			return (coding);
+	}
+	if ((accepted & (1 << CODING_GZIP)) && is_compressed_on_the_fly(file))
+		return (CODING_GZIP);
+	return (CODING_IDENTITY);
+}
+
+// Queue a 200 OK response with the file as the body, or a 404 Not Found if it does not exist.
+// The file is taken from the open file cache. Small files are served from the content cache, larger ones
+// only have their header built in memory, and their body is sent from the file with sendfile().
+// Text files are sent compressed to the clients that accept it, from their precompressed sidecar if there is one,
+// else compressed once by the server and kept in the content cache.
+// The files are opened and read by the I/O pool: until they are, nothing is queued and the request is handled
+// again once the pool is done.
+// Returns 1 if successful, 0 if the connection waits for the I/O pool, -1 if not.
+int	queue_file_response(conn_t *conn, http_request_t *request, route_kind_t route, char *file_path)
+{
+	open_file_t	*file;
+
+	if (!conn_open_file(conn, file_path, &file))
+		return (0);
+	// Case 2-1-1: If the file does not exist...
+	if (file == NULL)
+		return (conn_queue_canned_response(conn, CANNED_404));
+	// Case 2-1-2: If the file exists...
+	// Ranges are only served from the file as it is, so a GET with a Range field is not compressed.
+	char	*cache_control = find_cache_control(file_path + strlen(SERVER_ROOT), route);
+	int		is_get = strcmp(request_str(request, request->method), "GET") == 0;
+	char	*range = request_header(request, HDR_RANGE);
+	int		accepted = is_get && range != NULL ? 1 << CODING_IDENTITY
+		: accepted_codings(request_header(request, HDR_ACCEPT_ENCODING));
+	open_file_t	*sidecar;
+	int			coding = choose_coding(conn, file, accepted, &sidecar);
+	if (coding == -1)
+	{
+		open_file_release(file);
+		return (0);
+	}
+	// A conditional GET from a client that has the current version is answered without the body.
+	if (is_get && request_not_modified(request, file, coding))
+	{
+		open_file_release(sidecar);
+		return (queue_not_modified_response(conn, file, coding, cache_control));
+	}
+	// A GET with a Range field is answered with only the requested bytes.
+	if (is_get && range != NULL && request_range_applies(request, file))
+	{
+		byte_range_t	ranges[MAX_RANGES];
+		int				range_count = parse_byte_ranges(range, file->size, ranges);
+		if (range_count != -1)
+			return (queue_range_response(conn, file, get_file_extension(file_path), cache_control, ranges, range_count));
+	}
+	// The body is sent from the sidecar if there is one, which is cached as it is.
+	open_file_t		*body_file = sidecar != NULL ? sidecar : file;
+	cache_entry_t	*entry = content_cache_lookup(body_file, coding);
+	if (entry != NULL)
+	{
+		open_file_release(sidecar);
+		open_file_release(file);
+		return (conn_queue_cached_response(conn, entry));
+	}
+	// Bodies that fit in the content cache are read once into an entry, compressed if the server does it.
+	char	*body = NULL;
+	size_t	body_size = body_file->size;
+	int		compress = coding != CODING_IDENTITY && sidecar == NULL;
+	if ((compress || is_cacheable(body_file)) && !conn_load_file(conn, body_file, compress, &body, &body_size))
+	{
+		open_file_release(sidecar);
+		open_file_release(file);
+		return (0);
+	}
+	if (body == NULL && compress)
+	{
+		coding = CODING_IDENTITY;
+		body_size = file->size;
+	}
+	http_t	*response = arena_init_http_with_arg (&conn->arena, NULL, NULL, HTTP_VERSION, "200");
+	if (response == NULL)
+	{
+		ERROR_PRTF ("SERVER ERROR: Failed to create HTTP response\n");
+		free (body);
+		open_file_release(sidecar);
+		open_file_release(file);
+		return (-1);
+	}
+	char	content_length[32];
+	sprintf(content_length, "%zu", body_size);
+	char	*body_type = find_content_type(get_file_extension(file_path));
+	arena_add_field_to_http (&conn->arena, response, "Content-Length", content_length);
+	arena_add_field_to_http (&conn->arena, response, "Content-Type", body_type);
+	if (coding != CODING_IDENTITY)
+		arena_add_field_to_http (&conn->arena, response, "Content-Encoding", g_coding_names[coding]);
+	arena_add_field_to_http (&conn->arena, response, "Accept-Ranges", "bytes");
+	add_cache_fields(&conn->arena, response, file, coding, cache_control);
+	if (sidecar != NULL)
+		open_file_release(file);
+	// A body read in memory is sent from its entry, even if it does not fit in the cache after all.
+	if (body != NULL)
+	{
+		entry = cache_entry_create(body_file, coding, response, body, body_size);
+		open_file_release(body_file);
+		if (entry == NULL)
+			return (-1);
+		int	ret = conn_queue_cached_response(conn, entry);
+		if (!content_cache_add(entry))
+			cache_entry_release(entry);
+		return (ret);
+	}
+	return (conn_queue_file_response(conn, response, body_file, 0, body_file->size));
+}
+
+// ID:password of the protected files (Please do not change this.)
+#define AUTH_CREDENTIALS "DCN:FALL2023"
+#define BASE64_SIZE(len) (4 * (((len) + 2) / 3))
+
+// Expected token of the Authorization field, AUTH_CREDENTIALS encoded in BASE64 once by init_auth().
+char	g_auth_token[BASE64_SIZE(sizeof(AUTH_CREDENTIALS) - 1) + 1];
+size_t	g_auth_token_len;
+
+// Same as base64_encode() on the string data, written to encoded_data (BASE64_SIZE(strlen(data)) + 1 bytes).
+void	base64_encode_into(char *encoded_data, char *data)
+{
+	static const char	encoding_table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t				input_length = strlen(data);
+	size_t				output_length = BASE64_SIZE(input_length);
+
+	for (size_t i = 0, j = 0; i < input_length; i += 3, j += 4)
+	{
+		uint32_t	octet_a = (unsigned char)data[i];
+		uint32_t	octet_b = i + 1 < input_length ? (unsigned char)data[i + 1] : 0;
+		uint32_t	octet_c = i + 2 < input_length ? (unsigned char)data[i + 2] : 0;
+		uint32_t	triple = (octet_a << 0x10) + (octet_b << 0x08) + octet_c;
+
+		encoded_data[j] = encoding_table[(triple >> 3 * 6) & 0x3F];
+		encoded_data[j + 1] = encoding_table[(triple >> 2 * 6) & 0x3F];
+		encoded_data[j + 2] = i + 1 < input_length ? encoding_table[(triple >> 1 * 6) & 0x3F] : '=';
+		encoded_data[j + 3] = i + 2 < input_length ? encoding_table[(triple >> 0 * 6) & 0x3F] : '=';
+	}
+	encoded_data[output_length] = '\0';
+}
+
+// Encode the credentials of the protected files into g_auth_token.
+void	init_auth()
+{
+	base64_encode_into(g_auth_token, AUTH_CREDENTIALS);
+	g_auth_token_len = strlen(g_auth_token);
+}
+
+// Compare token with g_auth_token in a time that does not depend on where they differ.
+// Returns 1 if they are equal, 0 if not.
+int	auth_token_matches(char *token)
+{
+	size_t			len = strlen(token);
+	unsigned char	diff = len != g_auth_token_len;
+
+	for (size_t i = 0; i < g_auth_token_len; i++)
+		diff |= (unsigned char)token[i < len ? i : 0] ^ (unsigned char)g_auth_token[i];
+	return (diff == 0);
+}
+
+// The client sends "Basic <ID:password>" in the Authorization header field, <ID:password> encoded in BASE64.
+// Returns 1 if the request carries the credentials of the protected files, 0 if not.
+int	request_is_authorized(http_request_t *request)
+{
+	char	*input_auth = request_header(request, HDR_AUTHORIZATION);
+
+	// Any other scheme is refused, whatever follows it.
+	if (input_auth == NULL || strncasecmp(input_auth, "Basic ", 6) != 0)
+		return (0);
+	return (auth_token_matches(input_auth + 6));
+}
+
+typedef struct route_t
+{
+	char			*path;
+	route_kind_t	kind;
+	int				subtree; // Also route every path below this one, which must then end with '/'.
+}	route_t;
+
+route_t	g_routes[] = {
+	{"/", ROUTE_INDEX, 0},
+	{"/album.html", ROUTE_UPLOAD, 0},
+	{"/secret.html", ROUTE_PROTECTED, 0},
+	{"/public/khl.jpg", ROUTE_PROTECTED, 0},
+};
+
+// Node of the routing trie. Every byte of a path takes two steps, one per nibble, so a lookup
+// is linear in the length of the path whatever the number of routes.
+typedef struct route_node_t
+{
+	struct route_node_t	*child[16];
+	route_kind_t		exact; // Kind of the path ending here, ROUTE_STATIC if it has no route.
+	route_kind_t		prefix; // Kind of the paths below the one ending here, ROUTE_STATIC if none.
+}	route_node_t;
+
+route_node_t	g_route_root;
+
+// Returns the node of the trie after byte c, NULL if no route goes there.
+route_node_t	*route_step(route_node_t *node, unsigned char c)
+{
+	node = node->child[c >> 4];
+	return (node != NULL ? node->child[c & 0x0F] : NULL);
+}
+
+// Build the routing trie from g_routes.
+// Returns 0 if successful, -1 if not.
+int	init_router()
+{
+	for (size_t i = 0; i < sizeof(g_routes) / sizeof(g_routes[0]); i++)
+	{
+		route_node_t	*node = &g_route_root;
+		for (char *c = g_routes[i].path; *c != '\0'; c++)
+		{
+			unsigned char	nibbles[2] = {(unsigned char)*c >> 4, (unsigned char)*c & 0x0F};
+			for (int j = 0; j < 2; j++)
+			{
+				if (node->child[nibbles[j]] == NULL)
+					node->child[nibbles[j]] = (route_node_t *)calloc(1, sizeof(route_node_t));
+				if (node->child[nibbles[j]] == NULL)
+				{
+					ERROR_PRTF ("SERVER ERROR: Failed to build the routing table\n");
+					return (-1);
+				}
+				node = node->child[nibbles[j]];
+			}
+		}
+		if (g_routes[i].subtree)
+			node->prefix = g_routes[i].kind;
+		node->exact = g_routes[i].kind;
+	}
+	return (0);
+}
+
+// Returns the value of the hex digit c, -1 if it is not one.
+int	hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return (c - '0');
+	if (c >= 'a' && c <= 'f')
+		return (c - 'a' + 10);
+	if (c >= 'A' && c <= 'F')
+		return (c - 'A' + 10);
+	return (-1);
+}
+
+// Normalize the request path into "SERVER_ROOT + path" in file_path (MAX_PATH_SIZE bytes), and find its route
+// in the same pass. The query and fragment are dropped, %XX escapes decoded, "//" and "." segments removed,
+// and INDEX_FILE appended to ROUTE_INDEX directories.
+// Returns the route if successful, -1 if the path is invalid, leaves SERVER_ROOT (".." segments) or is too long.
+int	route_request(char *request_path, char *file_path)
+{
+	size_t			root_len = strlen(SERVER_ROOT);
+	char			*path = file_path + root_len;
+	size_t			path_size = MAX_PATH_SIZE - root_len - strlen(INDEX_FILE);
+	size_t			len = 0;
+	size_t			segment_start = 0; // Offset right after the last '/' of path.
+	route_node_t	*node = &g_route_root;
+	route_node_t	*segment_node = node;
+	route_kind_t	prefix = ROUTE_STATIC;
+
+	if (request_path[0] != '/')
+		return (-1);
+	for (char *in = request_path; ; in++)
+	{
+		char	c = *in;
+		if (c == '%')
+		{
+			int	high = hex_value(in[1]);
+			int	low = high != -1 ? hex_value(in[2]) : -1;
+			if (low == -1 || (high == 0 && low == 0))
+				return (-1);
+			c = (char)(high << 4 | low);
+			in += 2;
+		}
+		else if (c == '?' || c == '#')
+			c = '\0';
+		if (c == '/' || c == '\0')
+		{
+			// Drop the segment if it is ".", refuse it if it is "..".
+			if (len - segment_start == 1 && path[segment_start] == '.')
+			{
+				len = segment_start;
+				node = segment_node;
+			}
+			else if (len - segment_start == 2 && path[segment_start] == '.' && path[segment_start + 1] == '.')
+				return (-1);
+			if (c == '\0')
+				break ;
+			if (len > 0 && len == segment_start)
+				continue ;
+		}
+		if (len + 1 >= path_size)
+			return (-1);
+		path[len++] = c;
+		node = node != NULL ? route_step(node, (unsigned char)c) : NULL;
+		if (c == '/')
+		{
+			segment_start = len;
+			segment_node = node;
+			if (node != NULL && node->prefix != ROUTE_STATIC)
+				prefix = node->prefix;
+		}
+	}
+	memcpy(file_path, SERVER_ROOT, root_len);
+	path[len] = '\0';
+	route_kind_t	kind = node != NULL && node->exact != ROUTE_STATIC ? node->exact : prefix;
+	if (kind == ROUTE_INDEX)
+		strcat(path, INDEX_FILE);
+	return (kind);
+}
+
+// Case 2: GET request is received, for file_path routed as route.
+// Returns 1 if the response is queued, -1 if not.
+int	handle_get_request(conn_t *conn, http_request_t *request, route_kind_t route, char *file_path)
+{
+	// First check if the requested file needs authorization. If so, check if the client is authorized.
+	// Case 2-2: If authorization failed...
+	// Send 401 Unauthorized with WWW-Authenticate field set to Basic.
+	if (route == ROUTE_PROTECTED && !request_is_authorized(request))
+		return (conn_queue_canned_response(conn, CANNED_401));
+	// Case 2-1: If authorization succeeded...
+	return (queue_file_response(conn, request, route, file_path));
+}
+
+// Case 3: POST request is received, for the upload endpoint at file_path.
+// The image in its multipart body was already saved to the album by upload, as the body was received.
+// Returns 1 if the response is queued, -1 if not.
+int	handle_post_request(conn_t *conn, http_request_t *request, char *file_path, upload_t *upload)
+{
+	if (upload == NULL || upload->state != MULTIPART_DONE)
+	{
+		ERROR_PRTF ("SERVER ERROR: Failed to parse HTTP post body.\n");
+		return (-1);
+	}
+	if (!upload->saved)
+	{
+		ERROR_PRTF ("SERVER ERROR: Invalid file type\n");
+		return (-1);
+	}
+	// Respond with a 200 OK.
+	return (queue_file_response(conn, request, ROUTE_UPLOAD, file_path));
+}
+
+// Queue the response for the fully received request of the connection.
+// Returns 1 if successful, -1 if the connection should be dropped without a response.
+int	handle_request(conn_t *conn)
+{
+	http_request_t	*request = &conn->request;
+	char			file_path[MAX_PATH_SIZE];
+	int				route = route_request(request_str(request, request->path), file_path);
+
+	if (route == -1)
+		return (conn_queue_canned_response(conn, CANNED_400));
+	// We must behave differently depending on the type of the request.
+	if (strncmp (request_str(request, request->method), "GET", 3) == 0)
+		return (handle_get_request(conn, request, route, file_path));
+	if (strncmp (request_str(request, request->method), "POST", 4) == 0 && route == ROUTE_UPLOAD)
+		return (handle_post_request(conn, request, file_path, conn->upload));
+	// Case 4: Other requests...
+	// Send 400 Bad Request.
+	return (conn_queue_canned_response(conn, CANNED_400_METHOD));
+}
+
+// Returns 1 if the client asked to keep the connection open after this request, 0 if not.
+int	request_wants_keep_alive(http_request_t *request)
+{
+	char	*connection = request_header(request, HDR_CONNECTION);
+
+	if (strcmp(request_str(request, request->version), "HTTP/1.1") == 0)
+		return (connection == NULL || strcasestr(connection, "close") == NULL);
+	return (connection != NULL && strcasestr(connection, "keep-alive") != NULL);
+}
+
+// Move on to the next request, once the response of the current one is queued.
+// If queued is 0, the handler waits for the I/O pool, and is run again once the pool is done.
+// Returns 1 if successful, -1 if the connection should be closed.
+int	conn_finish_request(conn_t *conn, int queued)
+{
+	if (queued == -1)
+		return (-1);
+	conn->handling = queued == 0;
+	if (conn->handling)
+		return (1);
+	io_job_free(conn->io_results);
+	conn->io_results = NULL;
+	if (!conn->keep_alive)
+	{
+		conn->state = CONN_CLOSING;
+		conn->linger = 1;
+		return (1);
+	}
+	// Keep the bytes already received after the current request, in the same buffer.
+	// With none, the buffer goes back to the pool until the next request arrives.
+	size_t	leftover = conn->header_len - conn->request_end;
+	if (leftover > 0)
+	{
+		memmove(conn->header_buffer, conn->header_buffer + conn->request_end, leftover);
+		conn->header_buffer[leftover] = '\0';
+	}
+	else
+	{
+		header_buffer_put(conn->header_buffer);
+		conn->header_buffer = NULL;
+	}
+	conn->header_len = leftover;
+	conn->header_scanned = 0;
+	conn->header_end = 0;
+	conn->request_end = 0;
+	free (conn->body_buffer);
+	conn->body_buffer = NULL;
+	conn->body_size = 0;
+	conn->body_received = 0;
+	upload_free (conn->upload);
+	conn->upload = NULL;
+	conn->state = CONN_READING_HEADER;
+	return (1);
+}
+
+// Take the next len bytes of the body of the current request, streamed to its upload by the I/O pool if it has one.
+// The bytes must stay as they are until the pool is done.
+// Returns 1 if successful, 0 if the connection waits for the I/O pool, -1 if the upload failed.
+int	conn_consume_body(conn_t *conn, char *data, size_t len)
+{
+	conn->body_received += len;
+	if (conn->upload == NULL || len == 0)
+		return (1);
+	io_job_t	*job = io_job_create(conn, IO_UPLOAD);
+	if (job == NULL)
+		return (-1);
+	job->upload = conn->upload;
+	job->data = data;
+	job->len = len;
+	if (conn_run_io(conn, job))
+		return (0);
+	return (conn_io_done(conn, job));
+}
+
+// Start the request whose header was parsed with parse_http_request(), returning header_size,
+// and handle it if it has no body to receive.
+// Returns 1 if successful, 0 if the connection waits for the I/O pool, -1 if the connection should be closed.
+int	conn_start_request(conn_t *conn, ssize_t header_size)
+{
+	// Case 1: If the received header message is too large...
+	// Send 431 Request Header Fields Too Large.
+	conn->request_count++;
+	if (header_size == PARSE_NEED_MORE || header_size == PARSE_TOO_MANY_FIELDS)
+	{
+		conn->keep_alive = 0;
+		return (conn_finish_request(conn, conn_queue_canned_response(conn, CANNED_431)));
+	}
+	if (header_size == PARSE_BAD_REQUEST)
+	{
+		ERROR_PRTF ("SERVER ERROR: Failed to parse HTTP request\n");
+		conn->keep_alive = 0;
+		return (conn_finish_request(conn, conn_queue_canned_response(conn, CANNED_400)));
+	}
+	conn->header_end = header_size;
+	conn->request_end = header_size;
+	printf ("\tHTTP ");
+	GREEN_PRTF ("REQUEST:\n");
+	print_http_request (&conn->request);
+	conn->keep_alive = g_config.keepalive_timeout > 0 && conn->request_count < g_config.keepalive_max
+		&& request_wants_keep_alive(&conn->request);
+
+	// Part of the body might have been received along with the header.
+	char	*content_length = request_header(&conn->request, HDR_CONTENT_LENGTH);
+	int		is_post = strncmp (request_str(&conn->request, conn->request.method), "POST", 4) == 0;
+	// A body we do not read would be taken for the next request, so do not reuse the connection.
+	if ((!is_post && content_length != NULL && atol(content_length) > 0)
+		|| request_header(&conn->request, HDR_TRANSFER_ENCODING) != NULL)
+		conn->keep_alive = 0;
+	if (is_post && content_length != NULL && atol(content_length) > 0)
+	{
+		// The body is received in chunks, streamed to the upload if the request is one, discarded if not.
+		char	file_path[MAX_PATH_SIZE];
+		conn->body_size = atol(content_length);
+		conn->body_buffer = (char *)malloc(BODY_CHUNK_SIZE);
+		if (conn->body_buffer == NULL)
+		{
+			ERROR_PRTF ("SERVER ERROR: Failed to allocate HTTP request body.\n");
+			return (-1);
+		}
+		if (route_request(request_str(&conn->request, conn->request.path), file_path) == ROUTE_UPLOAD)
+		{
+			conn->upload = upload_start(&conn->request);
+			if (conn->upload == NULL)
+				return (-1);
+		}
+		// Part of the body might have been received along with the header.
+		size_t	received = conn->header_len - conn->header_end;
+		if (received > conn->body_size)
+			received = conn->body_size;
+		conn->request_end += received;
+		conn->state = CONN_READING_BODY;
+		return (conn_consume_body(conn, conn->header_buffer + conn->header_end, received));
+	}
+	return (conn_finish_request(conn, handle_request(conn)));
+}
+
+// Handle every complete request already received, in order, until the output queue is full.
+// Returns 1 if the output queue is full, 0 if more bytes are needed, -1 if the connection should be closed.
+int	conn_handle_requests(conn_t *conn)
+{
+	while (conn->out_count < MAX_QUEUED_RESPONSES)
+	{
+		if (conn->io_job != NULL)
+			return (0);
+		if (conn->handling)
+		{
+			if (conn_finish_request(conn, handle_request(conn)) == -1)
+				return (-1);
+		}
+		else if (conn->state == CONN_READING_HEADER)
+		{
+			// Only the bytes received since the last search are searched, along with the 3 before them,
+			// which may start the blank line.
+			if (conn->header_len == 0)
+				return (0);
+			size_t	scan_from = conn->header_scanned > 3 ? conn->header_scanned - 3 : 0;
+			size_t	header_end = find_header_end(conn->header_buffer + scan_from, conn->header_len - scan_from);
+			conn->header_scanned = conn->header_len;
+			if (header_end == 0 && conn->header_len < MAX_HTTP_MSG_HEADER_SIZE)
+				return (0);
+			ssize_t	header_size = parse_http_request(conn->header_buffer, conn->header_len, &conn->request);
+			if (conn_start_request(conn, header_size) == -1)
+				return (-1);
+		}
+		else if (conn->state == CONN_READING_BODY)
+		{
+			if (conn->body_received < conn->body_size)
+				return (0);
+			if (conn_finish_request(conn, handle_request(conn)) == -1)
+				return (-1);
+		}
+		else
+			return (0);
+	}
+	return (1);
+}
+
+#ifdef HAVE_IO_URING
+// Take up to len bytes received by the io_uring engine for the connection, in order, and give the buffers
+// emptied back to the ring.
+// Returns the number of bytes taken, 0 if the client stopped sending, or -1 with errno set, EAGAIN if none yet.
+ssize_t	uring_take_received(conn_t *conn, char *buf, size_t len)
+{
+	uring_conn_t	*uc = &conn->uring;
+	size_t			taken = 0;
+
+	while (taken < len && uc->rx_head != -1)
+	{
+		int		bid = uc->rx_head;
+		size_t	copy_len = g_uring.buf_len[bid] - uc->rx_offset;
+		if (copy_len > len - taken)
+			copy_len = len - taken;
+		memcpy(buf + taken, g_uring.buffers + (size_t)bid * URING_BUFFER_SIZE + uc->rx_offset, copy_len);
+		taken += copy_len;
+		uc->rx_offset += copy_len;
+		if (uc->rx_offset < g_uring.buf_len[bid])
+			break ;
+		uc->rx_head = g_uring.buf_next[bid];
+		if (uc->rx_head == -1)
+			uc->rx_tail = -1;
+		uc->rx_offset = 0;
+		uc->rx_count--;
+		uring_recycle_buffer(bid);
+	}
+	if (taken > 0)
+		return (taken);
+	if (uc->rx_error != 0)
+	{
+		errno = uc->rx_error;
+		return (-1);
+	}
+	if (uc->rx_eof)
+		return (0);
+	errno = EAGAIN;
+	return (-1);
+}
+
+// Cancel the multishot receive of the connection, which is closing or splices its upload.
+void	uring_cancel_recv(conn_t *conn)
+{
+	uring_conn_t	*uc = &conn->uring;
+
+	if (!uc->recv_armed || uc->recv_cancelled || !uring_reserve(1))
+		return ;
+	struct io_uring_sqe	*sqe = uring_prep(IORING_OP_ASYNC_CANCEL, -1, conn, URING_CANCEL);
+	sqe->addr = (uintptr_t)conn | URING_RECV;
+	uc->recv_cancelled = 1;
+	uc->ops++;
+}
+
+// The I/O pool splices an upload from the socket of a connection of the io_uring engine only once the bytes
+// received in the buffers of the ring are taken, its receive is cancelled, and no send is in flight:
+// the socket is non-blocking while the I/O pool splices from it, and the sends of the ring expect it blocking.
+// Returns 1 if the I/O pool can splice, 0 if the bytes received are taken first, -1 if the connection waits.
+int	uring_splice_ready(conn_t *conn)
+{
+	uring_conn_t	*uc = &conn->uring;
+
+	if (uc->rx_head != -1 || uc->rx_eof || uc->rx_error != 0)
+		return (0);
+	uring_cancel_recv(conn);
+	if (uc->recv_armed || uc->sending)
+		return (-1);
+	return (set_nonblocking(conn->sock) == -1 ? 0 : 1);
+}
+#endif
+
+// Read up to len bytes of the connection, from its socket or from what the io_uring engine received for it.
+// Returns the number of bytes read, 0 if the client stopped sending, or -1 with errno set.
+ssize_t	conn_read(conn_t *conn, char *buf, size_t len)
+{
+#ifdef HAVE_IO_URING
+	if (uring_running())
+		return (uring_take_received(conn, buf, len));
+#endif
+	return (read(conn->sock, buf, len));
+}
+
+// Returns 1 if the next bytes of the body of the connection go from the socket to the file of its upload
+// without a copy, 0 if they are read. The last UPLOAD_SPLICE_TAIL bytes are always read.
+int	conn_splices_body(conn_t *conn)
+{
+	return (conn->state == CONN_READING_BODY && conn->upload != NULL && upload_can_splice(conn->upload)
+		&& conn->body_size - conn->body_received > UPLOAD_SPLICE_TAIL);
+}
+
+// Receive more bytes of the current request: header bytes go to header_buffer, body bytes are consumed
+// through body_buffer, one chunk at a time.
+// Returns 1 if bytes were received (or the client stopped sending), 0 if the socket has no more bytes yet
+// or the connection waits for the I/O pool, -1 on error.
+int	conn_receive(conn_t *conn)
+{
+	while (1)
+	{
+		ssize_t	bytes_received;
+		size_t	body_left = conn->body_size - conn->body_received;
+		int		splicing = conn_splices_body(conn);
+#ifdef HAVE_IO_URING
+		if (splicing && uring_running() && (splicing = uring_splice_ready(conn)) == -1)
+			return (0);
+#endif
+		if (splicing)
+		{
+			io_job_t	*job = io_job_create(conn, IO_SPLICE);
+			if (job == NULL)
+				return (-1);
+			job->upload = conn->upload;
+			job->sock = conn->sock;
+			job->len = body_left - UPLOAD_SPLICE_TAIL;
+			if (conn_run_io(conn, job))
+				return (0);
+			return (conn_io_done(conn, job));
+		}
+		if (conn->state == CONN_READING_BODY)
+			bytes_received = conn_read(conn, conn->body_buffer, body_left < BODY_CHUNK_SIZE ? body_left : BODY_CHUNK_SIZE);
+		else
+		{
+			if (conn->header_buffer == NULL && (conn->header_buffer = header_buffer_get()) == NULL)
+				return (-1);
+			bytes_received = conn_read(conn, conn->header_buffer + conn->header_len,
+				MAX_HTTP_MSG_HEADER_SIZE - conn->header_len);
+		}
+		if (bytes_received < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				if (conn->state == CONN_READING_HEADER && conn->header_len == 0)
+				{
+					header_buffer_put(conn->header_buffer);
+					conn->header_buffer = NULL;
+				}
+				return (0);
+			}
+			ERROR_PRTF ("SERVER ERROR: Failed to read HTTP request\n");
+			return (-1);
+		}
+		if (bytes_received == 0)
+		{
+			// The client will not send more requests, but may still wait for the queued responses.
+			conn->state = CONN_CLOSING;
+			return (1);
+		}
+		if (conn->state == CONN_READING_BODY)
+			return (conn_consume_body(conn, conn->body_buffer, bytes_received));
+		else
+		{
+			conn->header_len += bytes_received;
+			conn->header_buffer[conn->header_len] = '\0';
+		}
+		return (1);
+	}
+}
+
+// Returns the chunk buffer of the connection, allocated on first use, or NULL if not successful.
+// Only one chunk per connection is in memory at a time, however large the files it sends.
+char	*conn_send_chunk(conn_t *conn)
+{
+	if (conn->send_chunk == NULL)
+		conn->send_chunk = (char *)malloc(g_config.send_chunk_size);
+	return (conn->send_chunk);
+}
+
+// Send the next bytes of the file body of the item at the head of the output queue, and advance its offset.
+// The bytes go from the page cache to the socket with sendfile(), without being copied to user space.
+// Where sendfile() is not available, or fails for the file system of the file, they are read into the chunk
+// buffer and sent from there, a chunk at a time. A short send reads the rest of the chunk again.
+// Returns the number of bytes sent, or -1 with errno set.
+ssize_t	conn_send_file(conn_t *conn, out_item_t *item)
+{
+	open_file_t	*file = item->file;
+
+#ifdef __linux__
+	if (!file->no_sendfile)
+	{
+		ssize_t	bytes_sent = sendfile(conn->sock, file->fd, &item->file_offset, item->file_remaining);
+		if (bytes_sent != -1 || (errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP))
+			return (bytes_sent);
+		file->no_sendfile = 1;
+	}
+#endif
+	char	*chunk = conn_send_chunk(conn);
+	if (chunk == NULL)
+	{
+		errno = ENOMEM;
+		return (-1);
+	}
+	size_t	len = item->file_remaining < g_config.send_chunk_size ? item->file_remaining : g_config.send_chunk_size;
+	ssize_t	bytes_read = pread(file->fd, chunk, len, item->file_offset);
+	if (bytes_read <= 0)
+		return (bytes_read);
+	ssize_t	bytes_sent = write(conn->sock, chunk, bytes_read);
+	if (bytes_sent > 0)
+		item->file_offset += bytes_sent;
+	return (bytes_sent);
+}
+
+// Remove the fully sent response at the head of the output queue.
+void	conn_pop_out_item(conn_t *conn)
+{
+	out_item_t	*item = conn->out_head;
+
+	conn->out_head = item->next;
+	if (conn->out_head == NULL)
+		conn->out_tail = NULL;
+	conn->out_count--;
+	free_out_item (item);
+}
+
+// Gather the memory segments of the queued responses into iov, up to the first file body.
+// Sets *more if anything is left to send after them.
+// Returns the number of segments gathered.
+int	conn_gather_segments(conn_t *conn, struct iovec *iov, int *more)
+{
+	int	iov_count = 0;
+
+	*more = 0;
+	for (out_item_t *item = conn->out_head; item != NULL; item = item->next)
+	{
+		for (int i = item->seg_idx; i < item->seg_count; i++)
+		{
+			if (iov_count == MAX_IOVECS)
+			{
+				*more = 1;
+				return (iov_count);
+			}
+			iov[iov_count++] = item->segs[i];
+		}
+		if (item->file_remaining > 0)
+		{
+			*more = 1;
+			return (iov_count);
+		}
+	}
+	return (iov_count);
+}
+
+// Mark bytes_sent bytes of the gathered segments as sent, and drop the responses that are complete.
+void	conn_consume_segments(conn_t *conn, size_t bytes_sent)
+{
+	while (bytes_sent > 0)
+	{
+		out_item_t		*item = conn->out_head;
+		struct iovec	*seg = &item->segs[item->seg_idx];
+		size_t			len = bytes_sent < seg->iov_len ? bytes_sent : seg->iov_len;
+
+		seg->iov_base = (char *)seg->iov_base + len;
+		seg->iov_len -= len;
+		bytes_sent -= len;
+		if (seg->iov_len == 0)
+			item->seg_idx++;
+		if (item->seg_idx == item->seg_count && item->file_remaining == 0)
+			conn_pop_out_item(conn);
+	}
+}
+
+#ifdef HAVE_IO_URING
+// Slot of the open file in the fixed file table of the ring, so that its splices skip the lookup of its descriptor.
+// Only files in the open file cache get one, on their first splice by the io_uring engine, and keep it until closed.
+// Returns the slot, -1 if the file is read through its descriptor.
+int	uring_fixed_file(open_file_t *file)
+{
+	if (file->fixed_slot != -1 || g_uring.free_slot_count == 0 || fd_cache_find(file->path) != file)
+		return (file->fixed_slot);
+	int								slot = g_uring.free_slots[g_uring.free_slot_count - 1];
+	struct io_uring_rsrc_update2	update;
+	memset(&update, 0, sizeof(update));
+	update.offset = slot;
+	update.data = (uintptr_t)&file->fd;
+	update.nr = 1;
+	if (uring_register(IORING_REGISTER_FILES_UPDATE2, &update, sizeof(update)) != 1)
+		return (-1);
+	g_uring.free_slot_count--;
+	file->fixed_slot = slot;
+	return (slot);
+}
+
+// Create the pipe that the file bodies of the connection are spliced through, as large as a chunk if possible.
+// Returns 0 if successful, -1 if not.
+int	uring_open_pipe(conn_t *conn)
+{
+	uring_conn_t	*uc = &conn->uring;
+
+	if (uc->pipe_fds[0] != -1)
+		return (0);
+	// The pipe blocks, since the splices run in the workers of the ring, and a chunk always fits in it.
+	if (pipe2(uc->pipe_fds, O_CLOEXEC) == -1)
+	{
+		uc->pipe_fds[0] = -1;
+		return (-1);
+	}
+	int	pipe_size = fcntl(uc->pipe_fds[1], F_SETPIPE_SZ, (int)g_config.send_chunk_size);
+	if (pipe_size == -1)
+		pipe_size = fcntl(uc->pipe_fds[1], F_GETPIPE_SZ);
+	uc->pipe_size = pipe_size > 0 ? pipe_size : 4096;
+	return (0);
+}
+
+// Send the queued responses with the io_uring engine, like conn_flush(): the memory segments of consecutive
+// responses in one sendmsg, and file bodies in chunks, each spliced from the page cache into the pipe of the
+// connection by a splice linked to the one from the pipe to the socket, so they are not copied to user space.
+// The sends wait until every byte is sent, so the last one of a closing connection that does not linger is linked
+// to the close of its socket. If it is short, the close is cancelled and the connection goes on sending.
+// Returns 1 if the queue is empty, 0 if a send is in flight, -1 on error.
+int	uring_flush(conn_t *conn)
+{
+	uring_conn_t	*uc = &conn->uring;
+	out_item_t		*item = conn->out_head;
+
+	if (uc->sending)
+		return (0);
+	if (item == NULL)
+	{
+		arena_reset (&conn->arena);
+		return (1);
+	}
+	// A connection that lingers keeps receiving, to discard what its client still sends.
+	if (conn->state == CONN_CLOSING && !conn->linger)
+		uring_cancel_recv(conn);
+	int		more;
+	// What a short send left in the pipe goes before anything else.
+	int		iov_count = uc->pipe_len > 0 ? 0 : conn_gather_segments(conn, uc->iov, &more);
+	if ((iov_count == 0 && uring_open_pipe(conn) == -1) || !uring_reserve(3))
+	{
+		ERROR_PRTF ("SERVER ERROR: Failed to send response to client\n");
+		return (-1);
+	}
+	struct io_uring_sqe	*sqe;
+	if (iov_count > 0)
+	{
+		memset(&uc->msg, 0, sizeof(uc->msg));
+		uc->msg.msg_iov = uc->iov;
+		uc->msg.msg_iovlen = iov_count;
+		sqe = uring_prep(IORING_OP_SENDMSG, conn->sock, conn, URING_SEND);
+		sqe->addr = (uintptr_t)&uc->msg;
+		sqe->len = 1;
+		sqe->msg_flags = MSG_WAITALL | (more ? MSG_MORE : 0);
+		uc->send_file = 0;
+	}
+	else
+	{
+		size_t	len = uc->pipe_len;
+		if (len == 0)
+		{
+			int		slot = uring_fixed_file(item->file);
+			len = item->file_remaining < uc->pipe_size ? item->file_remaining : uc->pipe_size;
+			sqe = uring_prep(IORING_OP_SPLICE, uc->pipe_fds[1], conn, URING_SPLICE);
+			sqe->splice_fd_in = slot != -1 ? slot : item->file->fd;
+			sqe->splice_off_in = item->file_offset;
+			sqe->off = -1;
+			sqe->len = len;
+			sqe->splice_flags = SPLICE_F_MOVE | (slot != -1 ? SPLICE_F_FD_IN_FIXED : 0);
+			sqe->flags |= IOSQE_IO_LINK;
+			uc->splice_res = 0;
+			uc->ops++;
+		}
+		// A short splice into the pipe breaks the link, and the send is cancelled.
+		more = len < uc->pipe_len + item->file_remaining || item->next != NULL;
+		sqe = uring_prep(IORING_OP_SPLICE, conn->sock, conn, URING_SEND);
+		sqe->splice_fd_in = uc->pipe_fds[0];
+		sqe->splice_off_in = -1;
+		sqe->off = -1;
+		sqe->len = len;
+		sqe->splice_flags = SPLICE_F_MOVE | (more ? SPLICE_F_MORE : 0);
+		uc->send_file = 1;
+	}
+	uc->sending = 1;
+	uc->ops++;
+	if (!more && conn->state == CONN_CLOSING && !conn->linger)
+	{
+		sqe->flags |= IOSQE_IO_LINK;
+		uring_prep(IORING_OP_CLOSE, conn->sock, conn, URING_CLOSE);
+		uc->ops++;
+	}
+	return (0);
+}
+#endif
+
+// Send the queued responses to the client, in order.
+// The headers and in-memory bodies of consecutive responses leave in one sendmsg(), file bodies with conn_send_file().
+// When a file body follows, the header is sent with MSG_MORE so that both leave in the same segment.
+// Once everything is sent, the arena that backed the responses is reset.
+// Returns 1 if the queue is empty, 0 if the socket buffer is full, -1 on error.
+int	conn_flush(conn_t *conn)
+{
+#ifdef HAVE_IO_URING
+	if (uring_running())
+		return (uring_flush(conn));
+#endif
+	while (conn->out_head != NULL)
+	{
+		out_item_t		*item = conn->out_head;
+		struct iovec	iov[MAX_IOVECS];
+		int				more;
+		int				iov_count = conn_gather_segments(conn, iov, &more);
+		ssize_t			bytes_sent;
+		if (iov_count > 0)
+		{
+			struct msghdr	msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = iov_count;
+#ifdef MSG_MORE
+			bytes_sent = sendmsg(conn->sock, &msg, more ? MSG_MORE : 0);
+#else
+			bytes_sent = sendmsg(conn->sock, &msg, 0);
+#endif
+		}
+		else if (item->file_remaining > 0)
+			bytes_sent = conn_send_file(conn, item);
+		else
+			bytes_sent = 0;
+		if (bytes_sent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return (0);
+			ERROR_PRTF ("SERVER ERROR: Failed to send response to client\n");
+			return (-1);
+		}
+		if (iov_count > 0)
+		{
+			conn_consume_segments(conn, bytes_sent);
+			continue;
+		}
+		if (item->file_remaining > 0)
+		{
+			if (bytes_sent == 0)
+			{
+				ERROR_PRTF ("SERVER ERROR: File shrank while sending it to client\n");
+				return (-1);
+			}
+			item->file_remaining -= bytes_sent;
+			if (item->file_remaining > 0)
+				continue;
+		}
+		conn_pop_out_item(conn);
+	}
+	arena_reset (&conn->arena);
+	return (1);
+}
+
+#ifdef __linux__
+// Connections of this worker, least recently active first, to close the idle ones.
+conn_list_t	g_conn_list;
+// Lingering connections, in the order they started to linger, each closed after LINGER_TIMEOUT_MSEC.
+conn_list_t	g_linger_list;
+
+void	conn_list_remove(conn_t *conn)
+{
+	conn_list_t	*list = conn->list;
+
+	if (list == NULL)
+		return ;
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else
+		list->head = conn->next;
+	if (conn->next)
+		conn->next->prev = conn->prev;
+	else
+		list->tail = conn->prev;
+	conn->prev = NULL;
+	conn->next = NULL;
+	conn->list = NULL;
+}
+
+// Mark the connection as active now, moving it to the tail of the list.
+// A lingering connection only goes to the tail of the linger list once: what its client sends does not keep it open.
+void	conn_touch(conn_t *conn, size_t now)
+{
+	conn_list_t	*list = conn->state == CONN_LINGERING ? &g_linger_list : &g_conn_list;
+
+	if (conn->list == &g_linger_list)
+		return ;
+	conn_list_remove(conn);
+	conn->last_active_msec = now;
+	conn->prev = list->tail;
+	if (list->tail)
+		list->tail->next = conn;
+	else
+		list->head = conn;
+	list->tail = conn;
+	conn->list = list;
+}
+#endif
+
+// Discard what the client still sends once the last response of a closing connection is sent, until it stops
+// sending. Closing a socket with unread bytes makes the kernel reset the connection, and the client could lose
+// the response before reading it. The first call shuts the sending side down, so the client sees the end.
+// Returns 1 once the client stopped sending, 0 if it may send more, -1 on error.
+int	conn_linger(conn_t *conn)
+{
+	char	discard[4096];
+
+	if (conn->state != CONN_LINGERING)
+	{
+		conn->state = CONN_LINGERING;
+		if (shutdown(conn->sock, SHUT_WR) == -1)
+			return (-1);
+#ifdef __linux__
+		conn_touch(conn, get_time_msec());
+#endif
+	}
+	while (1)
+	{
+		ssize_t	bytes_received = conn_read(conn, discard, sizeof(discard));
+		if (bytes_received > 0)
+			continue;
+		if (bytes_received == 0)
+			return (1);
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return (0);
+		return (-1);
+	}
+}
+
+// Drive the state machine of a connection as far as its socket allows.
+// On a blocking socket this serves the whole connection in one call.
+// Returns 1 if the connection is done, 0 if it waits for the socket, -1 on error.
+int	conn_process(conn_t *conn)
+{
+	while (1)
+	{
+		int	queue_full = conn_handle_requests(conn);
+		if (queue_full == -1)
+			return (-1);
+		int	flushed = conn_flush(conn);
+		if (flushed == -1)
+			return (-1);
+		if (conn->state == CONN_CLOSING || conn->state == CONN_LINGERING)
+			return (flushed == 1 && conn->linger ? conn_linger(conn) : flushed);
+		// With a full queue, the requests already received come before reading more,
+		// and nothing is read while the client does not read its responses.
+		// Nothing is read either while the I/O pool works for the connection.
+		if (conn->io_job != NULL)
+			return (0);
+		if (queue_full)
+		{
+			if (flushed == 0)
+				return (0);
+			continue;
+		}
+		int	received = conn_receive(conn);
+		if (received <= 0)
+			return (received);
+	}
+}
+
+// Create the listening socket, bound to server_port.
+// With reuse_port, several sockets can be bound to the same port and the kernel spreads connections across them.
+// Returns the socket if successful, -1 if not.
+int	open_listening_socket(int server_port, int reuse_port)
+{
+	int server_listening_sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (server_listening_sock == -1)
+	{
+		ERROR_PRTF ("SERVER ERROR: socket() error\n");
+		return (-1);
+	}
+	// Set socket options to reuse the port immediately after the connection is closed
+	int	reuse = 1;
+	setsockopt(server_listening_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int));
+#ifdef SO_REUSEPORT
+	if (reuse_port && setsockopt(server_listening_sock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(int)) == -1)
+	{
+		ERROR_PRTF ("SERVER ERROR: setsockopt(SO_REUSEPORT) error\n");
+		close(server_listening_sock);
+		return (-1);
+	}
+#endif
+	// Bind server socket to the given port
+	struct sockaddr_in server_addr_info;
+	memset(&server_addr_info, 0, sizeof(server_addr_info));
+	server_addr_info.sin_family = AF_INET;
+	server_addr_info.sin_port = htons(server_port);
+	server_addr_info.sin_addr.s_addr = INADDR_ANY;
+	if (bind(server_listening_sock, (struct sockaddr*)&server_addr_info, sizeof(server_addr_info)) == -1)
+	{
+		ERROR_PRTF ("SERVER ERROR: bind() error\n");
+		close(server_listening_sock);
+		return (-1);
+	}
+	// Listen for incoming connections
+	if (listen(server_listening_sock, MAX_WAITING_CONNECTIONS) == -1)
+	{
+		ERROR_PRTF ("SERVER ERROR: listen() error\n");
+		close(server_listening_sock);
+		return (-1);
+	}
+	return (server_listening_sock);
+}
+
+#ifdef __linux__
+#ifdef HAVE_IO_URING
+// Stop what the io_uring engine does for a connection that is closed: its receive is cancelled,
+// and its send fails, or its poll completes, once its socket is shut down.
+void	uring_cancel_conn(conn_t *conn)
+{
+	uring_cancel_recv(conn);
+	if ((conn->uring.sending || conn->uring.polling) && conn->sock != -1)
+		shutdown(conn->sock, SHUT_RDWR);
+}
+#endif
+
+// Close the connection. If the I/O pool or the io_uring engine works for it, it is only freed once they are done.
+void	conn_close(conn_t *conn)
+{
+	conn_list_remove(conn);
+#ifdef HAVE_IO_URING
+	if (!conn->closed)
+		uring_cancel_conn(conn);
+	if (conn->uring.ops > 0)
+	{
+		conn->closed = 1;
+		return ;
+	}
+#endif
+	if (conn->io_job != NULL)
+	{
+		conn->closed = 1;
+		return ;
+	}
+	// The io_uring engine may have closed the socket already, along with the last send.
+	if (conn->sock != -1)
+		close(conn->sock);
+	conn_destroy(conn);
+}
+
+// Close the connections of the list that were last active timeout_msec ago or more.
+// Returns the time until the next one expires, -1 if there is none.
+int	close_expired_connections(conn_list_t *list, size_t timeout_msec, size_t now)
+{
+	while (list->head != NULL)
+	{
+		size_t	expire_msec = list->head->last_active_msec + timeout_msec;
+		if (expire_msec > now)
+			return (expire_msec - now);
+		conn_close(list->head);
+	}
+	return (-1);
+}
+
+// Close the connections that were idle for g_config.keepalive_timeout seconds,
+// and the ones that lingered for LINGER_TIMEOUT_MSEC.
+// Returns the epoll_wait() timeout until the next connection expires, -1 if there is none.
+int	close_idle_connections(size_t now)
+{
+	size_t	timeout_msec = (size_t)g_config.keepalive_timeout * 1000;
+	int		linger_wait = close_expired_connections(&g_linger_list, LINGER_TIMEOUT_MSEC, now);
+
+	if (timeout_msec == 0)
+		return (linger_wait);
+	int		idle_wait = close_expired_connections(&g_conn_list, timeout_msec, now);
+	if (linger_wait == -1 || (idle_wait != -1 && idle_wait < linger_wait))
+		return (idle_wait);
+	return (linger_wait);
+}
+
+// Give the jobs the I/O pool is done with back to their connections, and carry on with the connections.
+void	io_pool_complete()
+{
+	uint64_t	count;
+	while (read(g_io_pool.event_fd, &count, sizeof(count)) == -1 && errno == EINTR)
+		;
+	pthread_mutex_lock(&g_io_pool.lock);
+	io_job_t	*job = g_io_pool.done;
+	g_io_pool.done = NULL;
+	pthread_mutex_unlock(&g_io_pool.lock);
+	while (job != NULL)
+	{
+		io_job_t	*next = job->next;
+		conn_t		*conn = job->conn;
+		io_stats_add(job, 0);
+		conn->io_job = NULL;
+		if (conn->closed)
+		{
+			if (job->type == IO_OPEN)
+				open_file_release(fd_cache_end(&job->check));
+			io_job_free(job);
+			conn_close(conn);
+			job = next;
+			continue;
+		}
+		int	status = conn_io_done(conn, job);
+		conn_touch(conn, get_time_msec());
+		// A connection that waits for its socket only goes on if the socket had an event meanwhile.
+		if (status == -1 || ((status == 1 || conn->io_event) && conn_process(conn) != 0))
+			conn_close(conn);
+#ifdef HAVE_IO_URING
+		else if (uring_running())
+			uring_arm_later(conn);
+#endif
+		job = next;
+	}
+}
+
+// Accept every pending connection on the listening socket and register it to epoll.
+void	accept_connections(int epoll_fd, int server_listening_sock)
+{
+	while (1)
+	{
+		int client_connected_sock = accept4(server_listening_sock, NULL, NULL, SOCK_NONBLOCK);
+		if (client_connected_sock == -1)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				ERROR_PRTF ("SERVER ERROR: accept() error\n");
+			return ;
+		}
+		conn_t	*conn = conn_create(client_connected_sock);
+		if (conn == NULL)
+		{
+			close(client_connected_sock);
+			continue;
+		}
+		conn_touch(conn, get_time_msec());
+		// Edge-triggered: the connection reads/writes until EAGAIN on every event.
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.ptr = conn;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_connected_sock, &event) == -1)
+		{
+			ERROR_PRTF ("SERVER ERROR: epoll_ctl() error\n");
+			conn_close(conn);
+		}
+	}
+}
+
+// Serve every connection from one thread, multiplexed with edge-triggered epoll.
+// Returns -1 if the event loop fails.
+int	event_loop(int server_listening_sock)
+{
+	int	epoll_fd = epoll_create1(0);
+	if (epoll_fd == -1)
+	{
+		ERROR_PRTF ("SERVER ERROR: epoll_create1() error\n");
+		return (-1);
+	}
+	// The listening socket is the only entry without a connection attached.
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = NULL;
+	if (set_nonblocking(server_listening_sock) == -1
+		|| epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_listening_sock, &event) == -1)
+	{
+		ERROR_PRTF ("SERVER ERROR: epoll_ctl() error\n");
+		close(epoll_fd);
+		return (-1);
+	}
+	// So is the eventfd of the I/O pool, told apart by the pool as its pointer.
+	int	io_event_fd = io_pool_start();
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = &g_io_pool;
+	if (io_event_fd != -1 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, io_event_fd, &event) == -1)
+	{
+		ERROR_PRTF ("SERVER ERROR: epoll_ctl() error\n");
+		close(epoll_fd);
+		return (-1);
+	}
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	int	timeout_msec = -1;
+	while (1)
+	{
+		int	event_count = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, timeout_msec);
+		if (g_print_stats)
+		{
+			g_print_stats = 0;
+			print_server_stats();
+		}
+		if (event_count == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			ERROR_PRTF ("SERVER ERROR: epoll_wait() error\n");
+			break;
+		}
+		int	io_done = 0;
+		for (int i = 0; i < event_count; i++)
+		{
+			conn_t	*conn = (conn_t *)events[i].data.ptr;
+			if (conn == NULL)
+			{
+				accept_connections(epoll_fd, server_listening_sock);
+				continue;
+			}
+			if (events[i].data.ptr == &g_io_pool)
+			{
+				io_done = 1;
+				continue;
+			}
+			if (conn->closed)
+				continue;
+			conn_touch(conn, get_time_msec());
+			if (conn->io_job != NULL)
+				conn->io_event = 1;
+			if ((events[i].events & EPOLLERR) || conn_process(conn) != 0)
+				conn_close(conn);
+		}
+		// The connections of the jobs done go on once the events of the batch are handled,
+		// so that none of them is freed while an event of the batch still points to it.
+		if (io_done)
+			io_pool_complete();
+		timeout_msec = close_idle_connections(get_time_msec());
+	}
+	close(epoll_fd);
+	return (-1);
+}
+
+#ifdef HAVE_IO_URING
+// Release what uring_setup() set up, if it fails.
+void	uring_teardown()
+{
+	if (g_uring.ring_map != NULL && g_uring.ring_map != MAP_FAILED)
+		munmap(g_uring.ring_map, g_uring.ring_map_size);
+	if (g_uring.sqes != NULL && g_uring.sqes != MAP_FAILED)
+		munmap(g_uring.sqes, g_uring.sq_entries * sizeof(struct io_uring_sqe));
+	if (g_uring.buf_ring != NULL && g_uring.buf_ring != MAP_FAILED)
+		munmap(g_uring.buf_ring, URING_BUFFER_COUNT * sizeof(struct io_uring_buf));
+	free (g_uring.buffers);
+	free (g_uring.free_slots);
+	close(g_uring.fd);
+	memset(&g_uring, 0, sizeof(g_uring));
+	g_uring.fd = -1;
+}
+
+// Set up the io_uring of this worker, with its ring of receive buffers, and a fixed file table with a slot
+// per entry of the open file cache.
+// Returns 0 if successful, -1 if the kernel does not support io_uring or a feature the engine uses.
+int	uring_setup()
+{
+	struct io_uring_params	params;
+
+	// The ring is only used by the thread of the event loop, which lets the kernel skip some locking.
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+	g_uring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (g_uring.fd == -1 && errno == EINVAL)
+	{
+		memset(&params, 0, sizeof(params));
+		g_uring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	}
+	if (g_uring.fd == -1)
+		return (-1);
+	int	needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+	if ((params.features & needed) != needed)
+	{
+		uring_teardown();
+		return (-1);
+	}
+	size_t	sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	size_t	cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	g_uring.ring_map_size = sq_size > cq_size ? sq_size : cq_size;
+	g_uring.ring_map = mmap(NULL, g_uring.ring_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		g_uring.fd, IORING_OFF_SQ_RING);
+	g_uring.sq_entries = params.sq_entries;
+	g_uring.sqes = (struct io_uring_sqe *)mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, g_uring.fd, IORING_OFF_SQES);
+	g_uring.buf_ring = (struct io_uring_buf_ring *)mmap(NULL, URING_BUFFER_COUNT * sizeof(struct io_uring_buf),
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	g_uring.buffers = (char *)malloc((size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+	if (g_uring.ring_map == MAP_FAILED || g_uring.sqes == MAP_FAILED || g_uring.buf_ring == MAP_FAILED
+		|| g_uring.buffers == NULL)
+	{
+		ERROR_PRTF ("SERVER ERROR: Failed to map io_uring\n");
+		uring_teardown();
+		return (-1);
+	}
+	char	*ring = (char *)g_uring.ring_map;
+	g_uring.sq_head = (unsigned int *)(ring + params.sq_off.head);
+	g_uring.sq_tail = (unsigned int *)(ring + params.sq_off.tail);
+	g_uring.sq_mask = *(unsigned int *)(ring + params.sq_off.ring_mask);
+	g_uring.sq_array = (unsigned int *)(ring + params.sq_off.array);
+	g_uring.sq_local_tail = *g_uring.sq_tail;
+	g_uring.cq_head = (unsigned int *)(ring + params.cq_off.head);
+	g_uring.cq_tail = (unsigned int *)(ring + params.cq_off.tail);
+	g_uring.cq_mask = *(unsigned int *)(ring + params.cq_off.ring_mask);
+	g_uring.cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+
+	// The kernel picks a buffer of the ring for each receive, and the engine gives it back once its bytes are taken.
+	struct io_uring_buf_reg	buf_reg;
+	memset(&buf_reg, 0, sizeof(buf_reg));
+	buf_reg.ring_addr = (uintptr_t)g_uring.buf_ring;
+	buf_reg.ring_entries = URING_BUFFER_COUNT;
+	buf_reg.bgid = URING_BUFFER_GROUP;
+	if (uring_register(IORING_REGISTER_PBUF_RING, &buf_reg, 1) == -1)
+	{
+		uring_teardown();
+		return (-1);
+	}
+	for (int bid = 0; bid < URING_BUFFER_COUNT; bid++)
+		uring_recycle_buffer(bid);
+
+	// The slots of the fixed file table start empty, and are filled by uring_fixed_file().
+	struct io_uring_rsrc_register	files_reg;
+	memset(&files_reg, 0, sizeof(files_reg));
+	files_reg.nr = g_config.fd_cache_max;
+	files_reg.flags = IORING_RSRC_REGISTER_SPARSE;
+	g_uring.free_slots = (int *)malloc((g_config.fd_cache_max + 1) * sizeof(int));
+	if (g_uring.free_slots != NULL && g_config.fd_cache_max > 0
+		&& uring_register(IORING_REGISTER_FILES2, &files_reg, sizeof(files_reg)) == 0)
+	{
+		for (size_t slot = g_config.fd_cache_max; slot-- > 0;)
+			g_uring.free_slots[g_uring.free_slot_count++] = slot;
+	}
+	return (0);
+}
+
+// Arm a multishot accept on the listening socket. Each connection accepted comes as a completion.
+void	uring_arm_accept()
+{
+	if (!uring_reserve(1))
+		return ;
+	struct io_uring_sqe	*sqe = uring_prep(IORING_OP_ACCEPT, g_uring.listening_sock, NULL, URING_ACCEPT);
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+// Arm a multishot poll of the eventfd of the I/O pool.
+void	uring_poll_io_pool()
+{
+	if (!uring_reserve(1))
+		return ;
+	struct io_uring_sqe	*sqe = uring_prep(IORING_OP_POLL_ADD, g_io_pool.event_fd, NULL, URING_IO_POOL);
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->poll32_events = POLLIN;
+}
+
+// Arm a poll of the socket of the connection while its upload is spliced from it, so that the I/O pool splices
+// again once more bytes arrive. The bytes already received are taken first, and the I/O pool is not interrupted.
+void	uring_poll_splice(conn_t *conn)
+{
+	uring_conn_t	*uc = &conn->uring;
+
+	if (uc->polling || uc->rx_head != -1 || conn->io_job != NULL || !uring_reserve(1))
+		return ;
+	struct io_uring_sqe	*sqe = uring_prep(IORING_OP_POLL_ADD, conn->sock, conn, URING_POLL);
+	sqe->poll32_events = POLLIN | POLLRDHUP;
+	uc->polling = 1;
+	uc->ops++;
+}
+
+// Arm a multishot receive for the connection, unless it does not receive anymore: it is closing,
+// or the client stopped sending. While there are no free buffers in the ring, or the connection holds
+// URING_CONN_BUFFERS buffers it did not take yet, it waits in the starved list.
+// While its upload is spliced, its socket is polled instead.
+void	uring_arm_recv(conn_t *conn)
+{
+	uring_conn_t	*uc = &conn->uring;
+
+	if (uc->recv_armed || uc->starved || conn->closed || conn->state == CONN_CLOSING || uc->rx_eof
+		|| uc->rx_error != 0)
+		return ;
+	if (conn_splices_body(conn))
+	{
+		uring_poll_splice(conn);
+		return ;
+	}
+	if (g_uring.free_buffers == 0 || uc->rx_count >= URING_CONN_BUFFERS || !uring_reserve(1))
+	{
+		uring_arm_later(conn);
+		return ;
+	}
+	struct io_uring_sqe	*sqe = uring_prep(IORING_OP_RECV, conn->sock, conn, URING_RECV);
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	uc->recv_armed = 1;
+	uc->recv_cancelled = 0;
+	uc->ops++;
+}
+
+// Arm the receives of the starved connections that have buffers to receive into again.
+void	uring_arm_starved()
+{
+	conn_t	*conn = g_uring.starved;
+
+	if (g_uring.free_buffers == 0)
+		return ;
+	g_uring.starved = NULL;
+	while (conn != NULL)
+	{
+		conn_t	*next = conn->uring.starved_next;
+		conn->uring.starved = 0;
+		uring_arm_recv(conn);
+		conn = next;
+	}
+}
+
+// Keep the bytes of a receive of the connection until they are taken, in the buffer they were received in.
+void	uring_recv_done(conn_t *conn, int res, unsigned int flags)
+{
+	uring_conn_t	*uc = &conn->uring;
+
+	if (!(flags & IORING_CQE_F_MORE))
+		uc->recv_armed = 0;
+	if (flags & IORING_CQE_F_BUFFER)
+	{
+		int	bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		g_uring.free_buffers--;
+		if (res <= 0 || conn->closed)
+		{
+			uring_recycle_buffer(bid);
+			return ;
+		}
+		g_uring.buf_len[bid] = res;
+		g_uring.buf_next[bid] = -1;
+		if (uc->rx_tail != -1)
+			g_uring.buf_next[uc->rx_tail] = bid;
+		else
+			uc->rx_head = bid;
+		uc->rx_tail = bid;
+		uc->rx_count++;
+		// A client sending more than the connection handles stops being received from until it catches up.
+		if (uc->rx_count >= URING_CONN_BUFFERS)
+			uring_cancel_recv(conn);
+	}
+	else if (res == 0)
+		uc->rx_eof = 1;
+	else if (res != -ENOBUFS && res != -ECANCELED)
+		uc->rx_error = -res;
+}
+
+// Account the splice of a chunk of the file body of the first response of the connection into its pipe,
+// that completed with res: the file offset of the response is where the next chunk is spliced from.
+void	uring_splice_done(conn_t *conn, int res)
+{
+	uring_conn_t	*uc = &conn->uring;
+
+	uc->splice_res = res;
+	if (res <= 0 || conn->closed)
+		return ;
+	out_item_t	*item = conn->out_head;
+	item->file_offset += res;
+	item->file_remaining -= res;
+	uc->pipe_len += res;
+}
+
+// Account the send of the connection that completed with res.
+// Returns 1 if successful, -1 if the connection should be closed.
+int	uring_send_done(conn_t *conn, int res)
+{
+	uring_conn_t	*uc = &conn->uring;
+
+	uc->sending = 0;
+	if (res == -ECANCELED && uc->send_file && uc->splice_res > 0)
+		return (1); // The splice into the pipe was short: what it moved is sent next.
+	if (res == -ECANCELED && uc->send_file && uc->splice_res == 0)
+	{
+		ERROR_PRTF ("SERVER ERROR: File shrank while sending it to client\n");
+		return (-1);
+	}
+	if (res < 0)
+	{
+		ERROR_PRTF ("SERVER ERROR: Failed to send response to client\n");
+		return (-1);
+	}
+	if (!uc->send_file)
+	{
+		conn_consume_segments(conn, res);
+		return (1);
+	}
+	uc->pipe_len -= res;
+	if (uc->pipe_len == 0 && conn->out_head->file_remaining == 0)
+		conn_pop_out_item(conn);
+	return (1);
+}
+
+// Handle a completion of an operation of the connection, and carry on with the connection.
+void	uring_conn_complete(conn_t *conn, uring_op_t op, int res, unsigned int flags)
+{
+	int	status = 1;
+
+	if (!(flags & IORING_CQE_F_MORE))
+		conn->uring.ops--;
+	if (op == URING_RECV)
+		uring_recv_done(conn, res, flags);
+	else if (op == URING_SEND)
+		status = uring_send_done(conn, res);
+	else if (op == URING_SPLICE)
+		uring_splice_done(conn, res);
+	else if (op == URING_POLL)
+		conn->uring.polling = 0;
+	else if (op == URING_CLOSE && res >= 0)
+		conn->sock = -1;
+	if (conn->closed)
+	{
+		if (conn->uring.ops == 0 && conn->io_job == NULL)
+			conn_close(conn);
+		return ;
+	}
+	if (op != URING_RECV && op != URING_SEND && op != URING_POLL)
+		return ;
+	conn_touch(conn, get_time_msec());
+	if (conn->io_job != NULL)
+		conn->io_event = 1;
+	if (status == -1 || conn_process(conn) != 0)
+	{
+		conn_close(conn);
+		return ;
+	}
+	uring_arm_recv(conn);
+}
+
+// Handle the completion cqe.
+void	uring_complete(struct io_uring_cqe *cqe)
+{
+	conn_t		*conn = (conn_t *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+	uring_op_t	op = cqe->user_data & URING_OP_MASK;
+
+	if (op == URING_ACCEPT)
+	{
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			uring_arm_accept();
+		if (cqe->res < 0)
+		{
+			if (cqe->res != -EINTR && cqe->res != -ECONNABORTED && cqe->res != -EAGAIN)
+				ERROR_PRTF ("SERVER ERROR: accept() error\n");
+			return ;
+		}
+		conn = conn_create(cqe->res);
+		if (conn == NULL)
+		{
+			close(cqe->res);
+			return ;
+		}
+		conn_touch(conn, get_time_msec());
+		uring_arm_recv(conn);
+	}
+	else if (op == URING_IO_POOL)
+	{
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			uring_poll_io_pool();
+		io_pool_complete();
+	}
+	else
+		uring_conn_complete(conn, op, cqe->res, cqe->flags);
+}
+
+// Serve every connection with io_uring instead of epoll. The listening socket has a multishot accept armed,
+// each connection a multishot receive into the buffers of the ring, and the responses leave with sends that are
+// submitted along with the next wait: a busy worker makes one io_uring_enter() per batch of completions,
+// instead of several system calls per request.
+// Returns -1 if the loop fails.
+int	uring_loop(int server_listening_sock)
+{
+	g_uring.listening_sock = server_listening_sock;
+	uring_arm_accept();
+	if (io_pool_start() != -1)
+		uring_poll_io_pool();
+	int	timeout_msec = -1;
+	while (1)
+	{
+		uring_arm_starved();
+		struct io_uring_getevents_arg	arg;
+		struct __kernel_timespec		timeout;
+		memset(&arg, 0, sizeof(arg));
+		if (timeout_msec != -1)
+		{
+			timeout.tv_sec = timeout_msec / 1000;
+			timeout.tv_nsec = (timeout_msec % 1000) * 1000000L;
+			arg.ts = (uintptr_t)&timeout;
+		}
+		int	ret = uring_enter(uring_publish(), 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+		if (g_print_stats)
+		{
+			g_print_stats = 0;
+			print_server_stats();
+		}
+		if (ret == -1 && errno != EINTR && errno != ETIME && errno != EBUSY)
+		{
+			ERROR_PRTF ("SERVER ERROR: io_uring_enter() error\n");
+			break;
+		}
+		unsigned int	head = *g_uring.cq_head;
+		while (head != __atomic_load_n(g_uring.cq_tail, __ATOMIC_ACQUIRE))
+		{
+			struct io_uring_cqe	cqe = g_uring.cqes[head & g_uring.cq_mask];
+			__atomic_store_n(g_uring.cq_head, ++head, __ATOMIC_RELEASE);
+			g_uring.completions++;
+			uring_complete(&cqe);
+		}
+		timeout_msec = close_idle_connections(get_time_msec());
+	}
+	return (-1);
+}
+#endif
+
+// Serve the connections of the listening socket in this worker, with the io_uring engine if g_config asks for it
+// and the kernel supports it, else with epoll.
+// Returns -1 if the loop fails.
+int	worker_loop(int server_listening_sock)
+{
+#ifdef HAVE_IO_URING
+	if (g_config.io_uring && uring_setup() == 0)
+		return (uring_loop(server_listening_sock));
+	if (g_config.io_uring)
+		ERROR_PRTF ("SERVER ERROR: io_uring is not available, using epoll\n");
+#endif
+	return (event_loop(server_listening_sock));
+}
+
+// Pin the calling process to the worker_idx-th core it is allowed to run on.
+void	pin_worker_to_core(int worker_idx)
+{
+	cpu_set_t	allowed;
+	cpu_set_t	pinned;
+	int			allowed_count;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1
+		|| (allowed_count = CPU_COUNT(&allowed)) == 0)
+		return ;
+	int	target = worker_idx % allowed_count;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if (!CPU_ISSET(cpu, &allowed) || target-- > 0)
+			continue;
+		CPU_ZERO(&pinned);
+		CPU_SET(cpu, &pinned);
+		if (sched_setaffinity(0, sizeof(pinned), &pinned) == -1)
+			ERROR_PRTF ("SERVER ERROR: sched_setaffinity() error\n");
+		return ;
+	}
+}
+
+// Run g_config.num_workers worker processes, each with its own SO_REUSEPORT listening socket
+// and event loop, so accepts are spread across cores without any shared lock.
+// Returns -1 when every worker has exited.
+int	run_workers(int server_port)
+{
+	int		num_workers = g_config.num_workers;
+	int		*listening_socks = (int *)malloc(num_workers * sizeof(int));
+	pid_t	*worker_pids = (pid_t *)calloc(num_workers, sizeof(pid_t));
+	if (listening_socks == NULL || worker_pids == NULL)
+	{
+		ERROR_PRTF ("SERVER ERROR: Failed to allocate workers\n");
+		free(listening_socks);
+		free(worker_pids);
+		return (-1);
+	}
+	// Bind every shard before forking, so a bind error is reported once and nothing is left running.
+	for (int i = 0; i < num_workers; i++)
+	{
+		listening_socks[i] = open_listening_socket(server_port, 1);
+		if (listening_socks[i] == -1)
+		{
+			while (i-- > 0)
+				close(listening_socks[i]);
+			free(listening_socks);
+			free(worker_pids);
+			return (-1);
+		}
+	}
+	printf ("Starting %d workers...\n", num_workers);
+	for (int i = 0; i < num_workers; i++)
+	{
+		fflush(stdout);
+		worker_pids[i] = fork();
+		if (worker_pids[i] == -1)
+		{
+			ERROR_PRTF ("SERVER ERROR: fork() error\n");
+			continue;
+		}
+		if (worker_pids[i] == 0)
+		{
+			// Worker: keep only its own shard, and exit with the parent.
+			prctl(PR_SET_PDEATHSIG, SIGTERM);
+			for (int j = 0; j < num_workers; j++)
+				if (j != i)
+					close(listening_socks[j]);
+			if (g_config.pin_workers)
+				pin_worker_to_core(i);
+			int	ret = worker_loop(listening_socks[i]);
+			close(listening_socks[i]);
+			exit(ret == -1 ? 1 : 0);
+		}
+	}
+	for (int i = 0; i < num_workers; i++)
+		close(listening_socks[i]);
+
+	int		running = 0;
+	for (int i = 0; i < num_workers; i++)
+		running += worker_pids[i] > 0;
+	while (running > 0)
+	{
+		int		status;
+		pid_t	pid = wait(&status);
+		if (pid == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		ERROR_PRTF ("SERVER ERROR: Worker %d exited\n", (int)pid);
+		running--;
+	}
+	free(listening_socks);
+	free(worker_pids);
+	return (-1);
+}
+#endif
+
+// Initialize server socket and serve incoming connections.
+// On Linux, connections are multiplexed with worker_loop(), in g_config.num_workers processes.
+// Elsewhere, they are served one by one with server_routine().
+int server_engine (int server_port)
+{
+	load_server_config();
+	select_scanner();
+	init_known_headers();
+	init_auth();
+	if (init_router() == -1)
+		return (-1);
+	if (init_canned_responses() == -1)
+		return (-1);
+	signal(SIGPIPE, SIG_IGN);
+	// kill -USR1 prints the statistics of each worker.
+	signal(SIGUSR1, request_stats);
+#ifdef __linux__
+	if (g_config.num_workers > 1)
+		return (run_workers(server_port));
+#endif
+	int server_listening_sock = open_listening_socket(server_port, 0);
+	if (server_listening_sock == -1)
+		return (-1);
+#ifdef __linux__
+	int	ret = worker_loop(server_listening_sock);
+#else
+	int	ret = 0;
+	// Serve incoming connections forever
+	while (1)
+	{
+		int client_connected_sock = accept(server_listening_sock, NULL, NULL);
+		if (client_connected_sock == -1)
+			continue;
+		server_routine (client_connected_sock);
+		close(client_connected_sock);
+		if (g_print_stats)
+		{
+			g_print_stats = 0;
+			print_server_stats();
+		}
+	}
+#endif
+	close(server_listening_sock);
+	return (ret);
+}
+
+// Serve a single client connection on a blocking socket, until it is closed or idle.
+// Return -1 if error occurs, 0 otherwise.
+int server_routine (int client_sock)
+{
+	if (client_sock == -1)
+		return -1;
+
+	// Reads time out after the keep-alive timeout, so an idle client does not hold the server.
+	struct timeval	timeout = {g_config.keepalive_timeout, 0};
+	setsockopt(client_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	conn_t	*conn = conn_create(client_sock);
+	if (conn == NULL)
+		return (-1);
+	int	ret = conn_process(conn);
+	conn_destroy(conn);
+	return (ret == -1 ? -1 : 0);
 }